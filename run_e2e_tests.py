@@ -2,10 +2,12 @@
 
 import sys
 import re
+import json
 from pathlib import Path
 from collections import namedtuple
 from itertools import zip_longest
 import subprocess
+import tempfile
 
 JLOX_EXE = "./build/jlox"
 CLOX_EXE = "./build/clox"
@@ -18,18 +20,32 @@ EXPECTED_RUNTIME_ERROR_PATTERN = re.compile(r"// expect runtime error: (.+)")
 SYNTAX_ERROR_PATTERN = re.compile(r"\[.*line (\d+)\] (Error.+)")
 STACK_TRACE_PATTERN = re.compile(r"\[line (\d+)\]")
 NONTEST_PATTERN = re.compile(r"// nontest")
+BOOT_PATTERN = re.compile(r"// boot: (.+)")
+BATCH_SUMMARY_PATTERN = re.compile(
+    r"ran (\d+) scripts .*\n"
+    r"latency p50 ([\d.]+) ms, p90 ([\d.]+) ms, p99 ([\d.]+) ms, "
+    r"max ([\d.]+) ms")
 
 _n_passed = 0
 _n_failed = 0
 _n_skipped = 0
 _expectations = 0
 
-Suite = namedtuple("Suite", ["name", "language", "executable", "tests"])
+# `flags`, or a function that makes them when the suite starts, go before
+# the test's path; every test runs `runs` times, or is
+# handed to `check`, which runs it its own way and returns its failures;
+# `batch` suites run all their tests at once with clox --batch
+Suite = namedtuple("Suite",
+                   ["name", "language", "executable", "tests", "flags", "runs",
+                    "check", "batch"],
+                   defaults=[(), 1, None, False])
 
 _suite = None                   # Current suite
 _all_suites = {}
 _c_suites = []
 _java_suites = []
+_aliases = {}                   # Names that stand for several suites
+_cache_dir = None               # Where clox-cache keeps compiled tests
 
 
 class term:
@@ -75,6 +91,7 @@ class Test:
         self._expected_runtime_error = ""
         self._runtime_error_line = 0
         self._expected_exit_code = 0
+        self._boot_script = None    # Whose heap snapshot the test starts from
         self._failures = []
 
     def parse(self) -> bool:
@@ -101,6 +118,10 @@ class Test:
                 if match := NONTEST_PATTERN.search(line):
                     return False
 
+                if match := BOOT_PATTERN.search(line):
+                    self._boot_script = self.path.parent / match[1]
+                    continue
+
                 if match := EXPECTED_OUTPUT_PATTERN.search(line):
                     self._expected_output.append(ExpectedOutput(i, match[1]))
                     _expectations += 1
@@ -138,19 +159,49 @@ class Test:
     def run(self) -> list[str]:
         global _suite
 
-        result = subprocess.run([_suite.executable, self.path],
-                                stdout=subprocess.PIPE,
-                                stderr=subprocess.PIPE)
+        if _suite.check:
+            return _suite.check(self)
+
+        if not self._boot_script:
+            return self.run_with(_suite.flags)
+
+        # save the heap the boot script leaves behind and start from it
+        with tempfile.TemporaryDirectory(prefix="clox-snapshot-") as dir_:
+            snapshot = Path(dir_) / "heap.snapshot"
+            result = subprocess.run(
+                [_suite.executable, *_suite.flags, f"--snapshot={snapshot}",
+                 self._boot_script],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE)
+            if result.returncode != 0:
+                self._fail(f"Could not snapshot {self._boot_script}:",
+                           result.stderr.decode("utf-8").splitlines())
+                return self._failures
+            return self.run_with([*_suite.flags, f"--boot={snapshot}"])
+
+    def run_with(self, flags) -> list[str]:
+        for _ in range(_suite.runs):
+            result = subprocess.run(
+                [_suite.executable, *flags, self.path],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE)
+
+            self.validate(result.returncode, result.stdout.decode("utf-8"),
+                          result.stderr.decode("utf-8"))
+            if self._failures:
+                break
+        return self._failures
 
-        output_lines = result.stdout.decode("utf-8").split("\n")
-        error_lines = result.stderr.decode("utf-8").split("\n")
+    def validate(self, exit_code, stdout, stderr) -> list[str]:
+        output_lines = stdout.split("\n")
+        error_lines = stderr.split("\n")
 
         if self._expected_runtime_error:
             self._validate_runtime_error(error_lines)
         else:
             self._validate_compile_error(error_lines)
 
-        self._validate_exit_code(result.returncode, error_lines)
+        self._validate_exit_code(exit_code, error_lines)
         self._validate_output(output_lines)
         return self._failures
 
@@ -251,7 +302,11 @@ def run_test(path: Path | str):
     if not test.parse():
         return
 
-    failures = test.run()
+    report(path, test.run())
+
+
+def report(path: Path | str, failures: list[str]):
+    global _n_passed, _n_failed
     if not failures:
         _n_passed += 1
     else:
@@ -263,9 +318,80 @@ def run_test(path: Path | str):
         print("")
 
 
+def run_batch(paths: list[Path]):
+    """Runs the tests in one clox --batch and checks the record of each."""
+    global _suite
+    tests = []
+    for path in paths:
+        test = Test(path)
+        if "benchmark" not in str(path) and test.parse():
+            tests.append(test)
+
+    term.update_line(f"Running {len(tests)} tests in a batch")
+    result = subprocess.run(
+        [_suite.executable, *_suite.flags, "--batch",
+         *(str(test.path) for test in tests)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    records = [json.loads(line)
+               for line in result.stdout.decode("utf-8").splitlines()]
+
+    for test, record in zip_longest(tests, records, fillvalue=None):
+        if record is None:
+            report(test.path, ["Missing from the batch output."])
+        elif test is None:
+            report(record["path"], ["Unexpected in the batch output."])
+        elif record["path"] != str(test.path):
+            report(test.path, [f"Got the record of {record['path']}."])
+        else:
+            report(test.path, test.validate(
+                record["status"], record["stdout"], record["stderr"]))
+
+    # the batch exits with the worst status and sums it up on stderr
+    failures = []
+    statuses = [record["status"] for record in records]
+    if result.returncode != max(statuses, default=0):
+        failures.append(f"Exited with {result.returncode} when the worst "
+                        f"status was {max(statuses, default=0)}.")
+    summary = result.stderr.decode("utf-8")
+    if match := BATCH_SUMMARY_PATTERN.search(summary):
+        latencies = [float(x) for x in match.group(2, 3, 4, 5)]
+        slowest = max((record["ms"] for record in records), default=0)
+        if int(match[1]) != len(records):
+            failures.append(f"Summed up {match[1]} scripts instead of "
+                            f"{len(records)}.")
+        if latencies != sorted(latencies) or abs(latencies[3] - slowest) > 1e-3:
+            failures.append(f"Got latencies out of order: {match[0]}")
+    else:
+        failures.append("Expected a summary and got:")
+        failures.extend(summary.splitlines())
+    report("batch summary", failures)
+
+    # a heap snapshot that won't load fails each script, not the batch
+    result = subprocess.run(
+        [_suite.executable, *_suite.flags, "--boot=/nonexistent.snapshot",
+         "--batch", *(str(test.path) for test in tests[:2])],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    failures = []
+    records = [json.loads(line)
+               for line in result.stdout.decode("utf-8").splitlines()]
+    if len(records) != len(tests[:2]) or result.returncode != 74:
+        failures.append(f"Expected {len(tests[:2])} records and return "
+                        f"code 74 and got {len(records)} and "
+                        f"{result.returncode}.")
+    for record in records:
+        if (record["status"] != 74 or record["stderr"] !=
+                "Could not load heap snapshot /nonexistent.snapshot\n"):
+            failures.append(f"Expected a failed boot and got: {record}")
+    report("batch boot failure", failures)
+
+
 def run_suite(name: str) -> bool:
     global _suite, _all_suites, _n_passed, _n_failed, _n_skipped, _expectations
     _suite = _all_suites[name]
+    if callable(_suite.flags):
+        _suite = _suite._replace(flags=_suite.flags())
     _n_passed = 0
     _n_failed = 0
     _n_skipped = 0
@@ -274,8 +400,11 @@ def run_suite(name: str) -> bool:
     if not Path(_suite.executable).exists():
         raise ValueError(f"Executable {_suite.executable} does not exist!")
 
-    for file_ in Path("./e2e_tests").rglob("*.lox"):
-        run_test(file_)
+    if _suite.batch:
+        run_batch(list(Path("./e2e_tests").rglob("*.lox")))
+    else:
+        for file_ in Path("./e2e_tests").rglob("*.lox"):
+            run_test(file_)
 
     term.clear_line()
     if _n_failed == 0:
@@ -294,16 +423,19 @@ def run_suites(names: list[str]) -> bool:
         print(f"=== {name} ===")
         return run_suite(name)
 
-    all_success = all(_run(name) for name in names)
+    # run every suite, even after one has failed
+    all_success = all([_run(name) for name in names])
     if not all_success:
         sys.exit(1)
 
 
 def _define_test_suites():
-    def c_suite(name: str, tests: dict[str, str]):
+    def c_suite(name: str, tests: dict[str, str], flags=(), runs=1,
+                check=None, batch=False):
         global _all_suites, _c_suite
         _all_suites[name] = Suite(
-            name, language="c", executable=CLOX_EXE, tests=tests)
+            name, language="c", executable=CLOX_EXE, tests=tests,
+            flags=flags, runs=runs, check=check, batch=batch)
         _c_suites.append(name)
 
     def java_suite(name: str, tests: dict[str, str]):
@@ -313,11 +445,36 @@ def _define_test_suites():
             executable=JLOX_EXE, tests=tests)
         _java_suites.append(name)
 
-    def scanner_suite(name: str, tests: dict[str, str]):
+    def check_output_order(test):
+        # everything a test prints must come out before its errors, also
+        # when both go down the same pipe
+        failures = test.run_with(_suite.flags)
+        if failures:
+            return failures
+        args = [_suite.executable, *_suite.flags, test.path]
+        apart = subprocess.run(
+            args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        together = subprocess.run(
+            args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        if together.stdout != apart.stdout + apart.stderr:
+            return ["Expected the output before the errors and got:",
+                    *together.stdout.decode("utf-8").splitlines()]
+        return []
+
+    def scanner_suite(name: str, tests: dict[str, str], check=None):
         global _all_suites
         _all_suites[name] = Suite(
             name, language="java",
-            executable=SCANNER_EXE, tests=tests)
+            executable=SCANNER_EXE, tests=tests, check=check)
+
+    def check_parallel_scan(test):
+        result = subprocess.run(
+            [SCANNER_EXE, "--check-parallel", test.path],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT)
+        if result.returncode == 0:
+            return []
+        return result.stdout.decode("utf-8").splitlines()
 
     all = {"e2e_tests": "pass"}
 
@@ -326,6 +483,8 @@ def _define_test_suites():
         "e2e_tests/expressions": "skip",
     }
     no_limits = {"e2e_tests/limit": "skip"}
+    # only clox saves heap snapshots, and a batch boots every script alike
+    booted = {"e2e_tests/snapshot/boot_globals.lox": "skip"}
 
     # jlox now have the same scanning procedure as clox,
     # so this test should be ignored
@@ -337,10 +496,35 @@ def _define_test_suites():
         "e2e_tests/scanning": "pass"
     }
 
-    java_suite("jlox", all | early_chapters | no_limits | unexpected_char)
+    java_suite("jlox",
+               all | early_chapters | no_limits | unexpected_char | booted)
     scanner_suite("scanner", scanner_only)
+    # every test scanned in parallel, split at each line it can be
+    scanner_suite("scanner-parallel", all, check=check_parallel_scan)
     c_suite("clox", all | early_chapters)
 
+    # the same tests again through each of clox's optional code paths
+    c_suite("clox-lazy", all | early_chapters, flags=["--lazy"])
+    c_suite("clox-predecode", all | early_chapters, flags=["--predecode"])
+    c_suite("clox-stack-cache", all | early_chapters,
+            flags=["--stack-cache"])
+    c_suite("clox-registers", all | early_chapters, flags=["--registers"])
+    # the first run compiles and stores each script, the second loads it
+    def cache_flags():
+        global _cache_dir
+        _cache_dir = tempfile.TemporaryDirectory(prefix="clox-cache-")
+        return [f"--cache={_cache_dir.name}"]
+    c_suite("clox-cache", all | early_chapters, flags=cache_flags, runs=2)
+    # under each flush policy, with the output and errors kept in order
+    c_suite("clox-flush-line", all | early_chapters | booted,
+            flags=["--flush=line"], check=check_output_order)
+    c_suite("clox-flush-size", all | early_chapters | booted,
+            flags=["--flush=size"], check=check_output_order)
+    # all the tests in one process, two at a time
+    c_suite("clox-batch", all | early_chapters | booted, flags=["--jobs=2"],
+            batch=True)
+    _aliases["clox-all"] = list(_c_suites)
+
 
 def main(args):
     global _suite
@@ -348,6 +532,8 @@ def main(args):
 
     if len(args) > 2:
         sys.exit(f"Usage: {sys.argv[0]} suite")
+    elif len(args) == 2 and args[1] in _aliases:
+        run_suites(_aliases[args[1]])
     elif len(args) == 2:
         run_suite(args[1])
     else:
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string_view>
+#include <thread>
+
+#include "batch_runner.hpp"
+
+namespace Clox {
+
+BatchRunner::BatchRunner(Setup setup, unsigned threads)
+    : setup(std::move(setup)), threads(std::max(threads, 1u)) {}
+
+std::vector<BatchRunner::Result>
+BatchRunner::run(const std::vector<std::string> &paths) const {
+    std::vector<Result> results(paths.size());
+    // workers take the next script as soon as they are done with one, so
+    // a few slow scripts don't hold up the rest
+    std::atomic<std::size_t> next{0};
+    auto work = [&] {
+        for (std::size_t i = next++; i < paths.size(); i = next++)
+            results[i] = runScript(paths[i]);
+    };
+
+    std::vector<std::thread> workers;
+    auto count = std::min<std::size_t>(threads, paths.size());
+    for (std::size_t i = 0; i < count; i++)
+        workers.emplace_back(work);
+    for (auto &worker : workers)
+        worker.join();
+    return results;
+}
+
+BatchRunner::Result BatchRunner::runScript(const std::string &path) const {
+    Result result{path, 0, 0, "", ""};
+    char *errors = nullptr;
+    std::size_t errorsSize = 0;
+    std::FILE *errorStream = open_memstream(&errors, &errorsSize);
+    if (!errorStream)
+        throw std::bad_alloc();
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        StackVM vm;
+        setup(vm);
+        vm.captureOutput(result.output, errorStream);
+        result.status = vm.runScript(path.c_str());
+    } // the VM writes out the rest of its output when it is destroyed
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+
+    std::fclose(errorStream);
+    result.errors.assign(errors, errorsSize);
+    std::free(errors);
+    return result;
+}
+
+std::vector<std::string> BatchRunner::readManifest(const char *path) {
+    std::ifstream file(path);
+    if (!file)
+        throw std::ios_base::failure("Manifest does not exist!");
+
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(file, line)) {
+        auto end = line.find_last_not_of(" \t\r");
+        line.erase(end == std::string::npos ? 0 : end + 1);
+        if (!line.empty() && line[0] != '#')
+            paths.push_back(line);
+    }
+    return paths;
+}
+
+static void appendJson(std::string &out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[7];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+void BatchRunner::writeResults(std::ostream &out,
+                               const std::vector<Result> &results) {
+    std::string line;
+    for (const Result &result : results) {
+        char timing[64];
+        std::snprintf(timing, sizeof(timing),
+                      ", \"status\": %d, \"ms\": %.3f", result.status,
+                      result.seconds * 1000);
+        line = "{\"path\": ";
+        appendJson(line, result.path);
+        line += timing;
+        line += ", \"stdout\": ";
+        appendJson(line, result.output);
+        line += ", \"stderr\": ";
+        appendJson(line, result.errors);
+        line += "}\n";
+        out << line;
+    }
+    out.flush();
+}
+
+void BatchRunner::writeSummary(std::ostream &out,
+                               const std::vector<Result> &results,
+                               double seconds, unsigned threads) {
+    std::vector<double> latencies;
+    latencies.reserve(results.size());
+    for (const Result &result : results)
+        latencies.push_back(result.seconds * 1000);
+    std::sort(latencies.begin(), latencies.end());
+
+    // nearest rank: the smallest latency at least `percent`% of scripts
+    // didn't exceed
+    auto percentile = [&](double percent) {
+        if (latencies.empty())
+            return 0.0;
+        auto rank = static_cast<std::size_t>(
+            std::ceil(percent / 100 * latencies.size()));
+        return latencies[std::max<std::size_t>(rank, 1) - 1];
+    };
+
+    char summary[256];
+    std::snprintf(summary, sizeof(summary),
+                  "ran %zu scripts on %u thread%s in %.3f s, %.1f scripts/s\n"
+                  "latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+                  "max %.3f ms\n",
+                  results.size(), threads, threads == 1 ? "" : "s", seconds,
+                  seconds > 0 ? results.size() / seconds : 0.0,
+                  percentile(50), percentile(90), percentile(99),
+                  percentile(100));
+    out << summary << std::flush;
+}
+
+} // namespace Clox
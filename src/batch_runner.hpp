@@ -0,0 +1,59 @@
+#ifndef CLOXPP_BATCH_RUNNER_H
+#define CLOXPP_BATCH_RUNNER_H
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "stack_vm.hpp"
+
+namespace Clox {
+
+/*
+ * Runs many scripts on a fixed pool of worker threads. Every script gets
+ * a fresh VM, with a heap of its own, on whichever worker picks it up, so
+ * scripts can't see each other's globals. What each script prints on
+ * stdout and stderr is captured apart from the others, along with its
+ * exit status and how long it took.
+ */
+class BatchRunner {
+public:
+    struct Result {
+        std::string path;
+        int status;     // as returned by StackVM::runScript
+        double seconds; // from creating the VM to the end of the script
+        std::string output;
+        std::string errors;
+    };
+
+    // applied to the VM of every script before it runs, on its worker
+    using Setup = std::function<void(StackVM &)>;
+
+    BatchRunner(Setup setup, unsigned threads);
+
+    // the results are in the order of `paths`
+    std::vector<Result> run(const std::vector<std::string> &paths) const;
+
+    // script paths, one per line, skipping blank lines and lines that
+    // start with '#'; throws std::ios_base::failure if `path` can't be read
+    static std::vector<std::string> readManifest(const char *path);
+
+    // one line of JSON per result
+    static void writeResults(std::ostream &out,
+                             const std::vector<Result> &results);
+    // throughput, and percentiles of the time taken by each script
+    static void writeSummary(std::ostream &out,
+                             const std::vector<Result> &results,
+                             double seconds, unsigned threads);
+
+private:
+    Setup setup;
+    unsigned threads;
+
+    Result runScript(const std::string &path) const;
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_BATCH_RUNNER_H
@@ -0,0 +1,104 @@
+#ifndef CLOXPP_BINARY_IO_H
+#define CLOXPP_BINARY_IO_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+
+namespace Clox {
+
+// Helpers for the on-disk formats (.loxc caches and heap snapshots).
+// Values are stored in host byte order; those files never leave the
+// machine that wrote them.
+
+template <typename T>
+void put(std::string &out, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+inline void putString(std::string &out, std::string_view str) {
+    put<int32_t>(out, static_cast<int32_t>(str.size()));
+    out.append(str);
+    out.push_back('\0'); // so that borrowed strings are NUL-terminated
+}
+
+inline void putPadding(std::string &out, std::size_t alignment) {
+    out.append((alignment - out.size() % alignment) % alignment, '\0');
+}
+
+// Writes `image` to a private file first and renames it over `path`, so
+// that readers in other processes or on other threads never see a
+// half-written file.
+inline bool writeFileAtomically(const std::string &path,
+                                const std::string &image) {
+    auto thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    std::string tmpPath = path + "." + std::to_string(getpid()) + "." +
+                          std::to_string(thread) + ".tmp";
+    bool written;
+    {
+        std::ofstream ofs(tmpPath, std::ios::out | std::ios::binary);
+        written = static_cast<bool>(ofs.write(image.data(), image.size()));
+    }
+    if (!written || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+struct BinaryReader {
+    const char *begin;
+    const char *cursor;
+    const char *end;
+
+    BinaryReader(const char *begin, const char *end)
+        : begin(begin), cursor(begin), end(end) {}
+
+    template <typename T>
+    bool get(T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (static_cast<std::size_t>(end - cursor) < sizeof(T))
+            return false;
+        std::memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return true;
+    }
+
+    bool getBytes(int32_t count, const char *&bytes) {
+        if (count < 0 || end - cursor < count)
+            return false;
+        bytes = cursor;
+        cursor += count;
+        return true;
+    }
+
+    bool getString(std::string_view &str) {
+        int32_t length;
+        const char *bytes;
+        if (!get(length) || length == INT32_MAX ||
+            !getBytes(length + 1, bytes) || bytes[length] != '\0')
+            return false;
+        str = std::string_view(bytes, length);
+        return true;
+    }
+
+    bool skipPadding(std::size_t alignment) {
+        const char *padding;
+        auto misalignment = (cursor - begin) % alignment;
+        return getBytes((alignment - misalignment) % alignment, padding);
+    }
+
+    bool atEnd() const { return cursor == end; }
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_BINARY_IO_H
@@ -0,0 +1,273 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binary_io.hpp"
+#include "bytecode_cache.hpp"
+#include "memory.hpp"
+
+namespace Clox {
+
+static constexpr char MAGIC[4] = {'L', 'O', 'X', 'C'};
+
+// code and line tables start at multiples of this in the image, so they
+// can be used in place
+static constexpr std::size_t IMAGE_ALIGNMENT = 8;
+static_assert(std::is_trivially_copyable_v<LineStart> &&
+              alignof(LineStart) <= IMAGE_ALIGNMENT);
+
+enum ConstantTag : uint8_t {
+    TAG_NIL,
+    TAG_NUMBER,
+    TAG_INTEGER,
+    TAG_BOOL,
+    TAG_STRING,
+    TAG_FUNCTION,
+    TAG_CLOSURE, // shared closure of a function without upvalues
+};
+
+static uint64_t hashSource(std::string_view source) {
+    /* 64-bit FNV-1a hash function impl */
+    uint64_t hash = 14695981039346656037u;
+    for (char c : source) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+std::unique_ptr<BytecodeImage> BytecodeImage::map(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd); // the mapping stays valid without the descriptor
+
+    if (data == MAP_FAILED)
+        return nullptr;
+    return std::unique_ptr<BytecodeImage>(new BytecodeImage(data, st.st_size));
+}
+
+BytecodeImage::BytecodeImage(void *data, std::size_t size)
+    : data(data), size(size) {}
+
+BytecodeImage::~BytecodeImage() { munmap(data, size); }
+
+const char *BytecodeImage::begin() const {
+    return static_cast<const char *>(data);
+}
+
+const char *BytecodeImage::end() const { return begin() + size; }
+
+std::string BytecodeCache::pathFor(const char *sourcePath,
+                                   std::string_view source,
+                                   const std::string &cacheDir) {
+    if (cacheDir.empty()) {
+        return std::string(sourcePath) + "c";
+    }
+
+    char name[sizeof("0123456789abcdef.loxc")];
+    std::snprintf(name, sizeof(name), "%016llx.loxc",
+                  static_cast<unsigned long long>(hashSource(source)));
+    return cacheDir + "/" + name;
+}
+
+ObjFunction *BytecodeCache::load(const BytecodeImage &image,
+                                 std::string_view source) {
+    BinaryReader in(image.begin(), image.end());
+    const char *magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    if (!in.getBytes(sizeof(MAGIC), magic) ||
+        std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !in.get(version) ||
+        version != VERSION || !in.get(sourceHash) ||
+        sourceHash != hashSource(source)) {
+        return nullptr;
+    }
+
+    ObjFunction *script = readFunction(in);
+    return in.atEnd() ? script : nullptr;
+}
+
+bool BytecodeCache::store(const std::string &path, std::string_view source,
+                          ObjFunction *script) {
+    std::string image(MAGIC, sizeof(MAGIC));
+    put<uint32_t>(image, VERSION);
+    put<uint64_t>(image, hashSource(source));
+    if (!writeFunction(image, script))
+        return false;
+
+    // concurrent runs of the same script never see a half-written cache
+    return writeFileAtomically(path, image);
+}
+
+bool BytecodeCache::writeFunction(std::string &out, ObjFunction *function) {
+    // there's no bytecode to store for a body that was never compiled
+    if (!function->isCompiled())
+        return false;
+
+    put<uint8_t>(out, function->name != nullptr);
+    if (function->name) {
+        putString(out, std::string_view(function->name->data(),
+                                        function->name->size()));
+    }
+    put<int32_t>(out, function->arity);
+    put<int32_t>(out, function->upvalueCount);
+
+    const Chunk *chunk = function->getChunk();
+    put<int32_t>(out, chunk->count);
+    putPadding(out, IMAGE_ALIGNMENT);
+    out.append(reinterpret_cast<const char *>(chunk->code), chunk->count);
+
+    put<int32_t>(out, chunk->lineCount);
+    putPadding(out, IMAGE_ALIGNMENT);
+    out.append(reinterpret_cast<const char *>(chunk->lines),
+               sizeof(LineStart) * chunk->lineCount);
+
+    put<int32_t>(out, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!writeConstant(out, chunk->constants.values[i]))
+            return false;
+    }
+    return true;
+}
+
+bool BytecodeCache::writeConstant(std::string &out, const Value &value) {
+    if (value.isType<Nil>()) {
+        put<uint8_t>(out, TAG_NIL);
+    } else if (value.isType<Number>()) {
+        put<uint8_t>(out, TAG_NUMBER);
+        put<Number>(out, value.asType<Number>());
+    } else if (value.isType<Integer>()) {
+        put<uint8_t>(out, TAG_INTEGER);
+        put<Integer>(out, value.asType<Integer>());
+    } else if (value.isType<bool>()) {
+        put<uint8_t>(out, TAG_BOOL);
+        put<uint8_t>(out, value.asType<bool>());
+    } else if (value.isType<ObjString *>()) {
+        const ObjString *str = value.asType<ObjString *>();
+        put<uint8_t>(out, TAG_STRING);
+        putString(out, std::string_view(str->data(), str->size()));
+    } else if (value.isType<ObjFunction *>()) {
+        put<uint8_t>(out, TAG_FUNCTION);
+        return writeFunction(out, value.asType<ObjFunction *>());
+    } else if (value.isType<ObjClosure *>()) {
+        put<uint8_t>(out, TAG_CLOSURE);
+        return writeFunction(out, value.asType<ObjClosure *>()->function);
+    } else {
+        return false; // natives and upvalues never appear as constants
+    }
+    return true;
+}
+
+ObjFunction *BytecodeCache::readFunction(BinaryReader &in) {
+    ObjFunction *function = Allocator::create<ObjFunction>();
+
+    uint8_t hasName;
+    if (!in.get(hasName))
+        return nullptr;
+    if (hasName) {
+        std::string_view name;
+        if (!in.getString(name))
+            return nullptr;
+        function->name = ObjString::borrow(name);
+    }
+
+    int32_t codeCount, lineCount, constantCount;
+    const char *code, *lines;
+    if (!in.get(function->arity) || !in.get(function->upvalueCount) ||
+        !in.get(codeCount) || !in.skipPadding(IMAGE_ALIGNMENT) ||
+        !in.getBytes(codeCount, code) || !in.get(lineCount) ||
+        !in.skipPadding(IMAGE_ALIGNMENT)) {
+        return nullptr;
+    }
+
+    constexpr auto lineSize = static_cast<int32_t>(sizeof(LineStart));
+    if (lineCount < 0 || lineCount > INT32_MAX / lineSize ||
+        !in.getBytes(lineCount * lineSize, lines)) {
+        return nullptr;
+    }
+
+    // executed in place; the VM never writes to a finished chunk
+    Chunk *chunk = function->getChunk();
+    chunk->isMapped = true;
+    chunk->code = reinterpret_cast<uint8_t *>(const_cast<char *>(code));
+    chunk->count = codeCount;
+    chunk->lines = reinterpret_cast<LineStart *>(const_cast<char *>(lines));
+    chunk->lineCount = lineCount;
+
+    if (!in.get(constantCount))
+        return nullptr;
+    for (int i = 0; i < constantCount; i++) {
+        Value value;
+        if (!readConstant(in, value))
+            return nullptr;
+        chunk->addConstant(value);
+    }
+
+    return function;
+}
+
+bool BytecodeCache::readConstant(BinaryReader &in, Value &value) {
+    uint8_t tag;
+    if (!in.get(tag))
+        return false;
+
+    switch (tag) {
+    case TAG_NIL:
+        value = Nil{};
+        return true;
+    case TAG_NUMBER: {
+        Number number;
+        if (!in.get(number))
+            return false;
+        value = number;
+        return true;
+    }
+    case TAG_INTEGER: {
+        Integer integer;
+        if (!in.get(integer))
+            return false;
+        value = integer;
+        return true;
+    }
+    case TAG_BOOL: {
+        uint8_t boolean;
+        if (!in.get(boolean))
+            return false;
+        value = boolean != 0;
+        return true;
+    }
+    case TAG_STRING: {
+        std::string_view str;
+        if (!in.getString(str))
+            return false;
+        value = ObjString::borrow(str);
+        return true;
+    }
+    case TAG_FUNCTION:
+    case TAG_CLOSURE: {
+        ObjFunction *function = readFunction(in);
+        if (!function)
+            return false;
+        if (tag == TAG_FUNCTION) {
+            value = function;
+        } else {
+            value = Allocator::create<ObjClosure>(function);
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+} // namespace Clox
@@ -0,0 +1,70 @@
+#ifndef CLOXPP_BYTECODE_CACHE_H
+#define CLOXPP_BYTECODE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "binary_io.hpp"
+#include "object.hpp"
+
+namespace Clox {
+
+/*
+ * A .loxc file mapped read-only into memory. Scripts loaded from it run
+ * their bytecode in place, and their strings keep pointing into it, so
+ * the image must outlive everything loaded from it. Processes mapping
+ * the same file share one copy of it in the page cache.
+ */
+class BytecodeImage {
+public:
+    static std::unique_ptr<BytecodeImage> map(const std::string &path);
+
+    BytecodeImage(const BytecodeImage &) = delete;
+    BytecodeImage &operator=(const BytecodeImage &) = delete;
+    ~BytecodeImage();
+
+    const char *begin() const;
+    const char *end() const;
+
+private:
+    BytecodeImage(void *data, std::size_t size);
+
+    void *data;
+    std::size_t size;
+};
+
+/*
+ * Compiled scripts saved to disk as .loxc files, so that running an
+ * unchanged script skips scanning and compiling. A file records the
+ * format version and a hash of the source it was compiled from; a file
+ * that doesn't match either is ignored and overwritten.
+ */
+class BytecodeCache {
+public:
+    // bump whenever the instruction set or the file layout changes
+    static constexpr uint32_t VERSION = 4;
+
+    // `<sourcePath>c` next to the source if `cacheDir` is empty,
+    // else a file in `cacheDir` named after the hash of `source`
+    static std::string pathFor(const char *sourcePath,
+                               std::string_view source,
+                               const std::string &cacheDir);
+
+    static ObjFunction *load(const BytecodeImage &image,
+                             std::string_view source);
+    static bool store(const std::string &path, std::string_view source,
+                      ObjFunction *script);
+
+private:
+    static bool writeFunction(std::string &out, ObjFunction *function);
+    static bool writeConstant(std::string &out, const Value &value);
+    static ObjFunction *readFunction(BinaryReader &in);
+    static bool readConstant(BinaryReader &in, Value &value);
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_BYTECODE_CACHE_H
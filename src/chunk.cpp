@@ -1,16 +1,23 @@
 #include "chunk.hpp"
+#include "decoded_chunk.hpp"
 #include "memory.hpp"
+#include "register_chunk.hpp"
 
 namespace Clox {
 
 Chunk::Chunk()
-    : count(0), capacity(0), code(nullptr), lines(nullptr), constants({}) {}
+    : count(0), capacity(0), code(nullptr), lineCount(0), lineCapacity(0),
+      lines(nullptr), constants({}), isMapped(false) {}
 
 Chunk::~Chunk() {
-    Allocator::freeArray<uint8_t>(code, capacity);
-    Allocator::freeArray<int>(lines, capacity);
+    if (!isMapped) {
+        Allocator::freeArray<uint8_t>(code, capacity);
+        Allocator::freeArray<LineStart>(lines, lineCapacity);
+    }
     count = 0;
     capacity = 0;
+    lineCount = 0;
+    lineCapacity = 0;
 }
 
 void Chunk::write(uint8_t byte, int line) {
@@ -18,11 +25,21 @@ void Chunk::write(uint8_t byte, int line) {
         auto oldCapacity = capacity;
         capacity = Allocator::growCapacity(oldCapacity);
         code = Allocator::growArray<uint8_t>(code, oldCapacity, capacity);
-        lines = Allocator::growArray<int>(lines, oldCapacity, capacity);
     }
 
     code[count] = byte;
-    lines[count] = line;
+
+    // only start a new run when the line changes
+    if (lineCount == 0 || lines[lineCount - 1].line != line) {
+        if (lineCapacity < lineCount + 1) {
+            auto oldCapacity = lineCapacity;
+            lineCapacity = Allocator::growCapacity(oldCapacity);
+            lines = Allocator::growArray<LineStart>(lines, oldCapacity,
+                                                    lineCapacity);
+        }
+        lines[lineCount++] = {count, line};
+    }
+
     count++;
 }
 
@@ -33,4 +50,35 @@ int Chunk::addConstant(Value value) {
     return constants.count - 1;
 }
 
+void Chunk::clear() {
+    decoded.reset();
+    registers.reset();
+    count = 0;
+    lineCount = 0;
+    constants.count = 0;
+}
+
+void Chunk::truncate(int offset) {
+    count = offset;
+    while (lineCount > 0 && lines[lineCount - 1].offset >= offset) {
+        lineCount--;
+    }
+}
+
+int Chunk::getLine(int offset) const {
+    // binary search for the last run starting at or before `offset`
+    int low = 0;
+    int high = lineCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return lines[low].line;
+}
+
 } // namespace Clox
@@ -2,13 +2,21 @@
 #define CLOXPP_CHUNK_H
 
 #include <cstdint>
+#include <memory>
 
 #include "value.hpp"
 
+// largest operand of the *_LONG instructions, which take 3 bytes
+#define UINT24_MAX ((1 << 24) - 1)
+
 namespace Clox {
 
+class DecodedChunk;
+class RegisterChunk;
+
 enum OpCode {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -16,10 +24,14 @@ enum OpCode {
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_FLAT_UPVALUE,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -31,25 +43,73 @@ enum OpCode {
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
+    // Compare two operands and jump when the comparison is false. Each
+    // comparison comes in three consecutive forms: operands popped off the
+    // stack, two local slots, or a local slot and a constant.
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_LOCALS,
+    OP_JUMP_IF_NOT_LESS_LOCAL_CONST,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS,
+    OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_LOCALS,
+    OP_JUMP_IF_NOT_GREATER_LOCAL_CONST,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL_LOCALS,
+    OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_EQUAL_LOCALS,
+    OP_JUMP_IF_EQUAL_LOCAL_CONST,
     OP_LOOP,
+    OP_LOOP_LONG,
     OP_CALL,
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
 };
 
+// How OP_CLOSURE fills each upvalue slot of the new closure; emitted as the
+// first byte of every (kind, index) operand pair
+enum CaptureKind {
+    CAPTURE_UPVALUE,     // copy the enclosing closure's slot as is
+    CAPTURE_LOCAL,       // box the enclosing frame's local in an ObjUpvalue
+    CAPTURE_LOCAL_VALUE, // copy the local directly; it's never reassigned
+};
+
+// first bytecode offset of a run of bytes that share a source line
+struct LineStart {
+    int offset;
+    int line;
+};
+
 struct Chunk {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart *lines; // sorted by offset, one entry per change of line
     ValueArray constants;
+    bool isMapped; // `code` and `lines` point into a BytecodeImage
+    // built by VM::runDecoded when first run
+    std::unique_ptr<DecodedChunk> decoded;
+    std::unique_ptr<RegisterChunk> registers; // and by VM::runRegisters
 
     Chunk();
     ~Chunk();
     void write(uint8_t byte, int line);
     int addConstant(Value value);
+    void clear(); // drop everything written, keeping the buffers
+    void truncate(int offset); // drop the code from `offset` on
+    int getLine(int offset) const;
 };
 
 } // namespace Clox
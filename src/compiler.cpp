@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cstdio>
+#include <cstring>
+#include <limits>
 #include <string>
 
 #include "chunk.hpp"
@@ -10,56 +14,74 @@
 
 namespace Clox {
 
-std::unique_ptr<Parser> SinglePassCompiler::parser = nullptr;
-std::unique_ptr<Compiler> SinglePassCompiler::current = nullptr;
-
-// clang-format off
-std::unordered_map<TokenType, ParseRule> PrattParser::rules = {
-    { TokenType::LEFT_PAREN,    { &Compiler::grouping, &Compiler::call, Precedence::CALL }},
-    { TokenType::MINUS,         { &Compiler::unary,   &Compiler::binary, Precedence::TERM }},
-    { TokenType::PLUS,          { nullptr, &Compiler::binary, Precedence::TERM }},
-    { TokenType::SLASH,         { nullptr, &Compiler::binary, Precedence::FACTOR }},
-    { TokenType::STAR,          { nullptr, &Compiler::binary, Precedence::FACTOR }},
-    { TokenType::NUMBER,        { &Compiler::number, nullptr, Precedence::NONE }},
-    { TokenType::STRING,        { &Compiler::string, nullptr, Precedence::NONE }},
-    { TokenType::NIL,           { &Compiler::literal, nullptr, Precedence::NONE }},
-    { TokenType::TRUE,          { &Compiler::literal, nullptr, Precedence::NONE }},
-    { TokenType::FALSE,         { &Compiler::literal, nullptr, Precedence::NONE }},
-    { TokenType::BANG,          { &Compiler::unary, nullptr, Precedence::NONE }},
-    { TokenType::BANG_EQUAL,    { nullptr, &Compiler::binary, Precedence::EQUALITY }},
-    { TokenType::EQUAL_EQUAL,   { nullptr, &Compiler::binary, Precedence::EQUALITY }},
-    { TokenType::GREATER,       { nullptr, &Compiler::binary, Precedence::COMPARISON }},
-    { TokenType::GREATER_EQUAL, { nullptr, &Compiler::binary, Precedence::COMPARISON }},
-    { TokenType::LESS,          { nullptr, &Compiler::binary, Precedence::COMPARISON }},
-    { TokenType::LESS_EQUAL,    { nullptr, &Compiler::binary, Precedence::COMPARISON }},
-    { TokenType::IDENTIFIER,    { &Compiler::variable, nullptr, Precedence::NONE }},
-    { TokenType::AND,           { nullptr, &Compiler::andOp, Precedence::AND}},
-    { TokenType::OR,            { nullptr, &Compiler::orOp, Precedence::OR }},
+static constexpr std::size_t TOKEN_TYPE_COUNT =
+    static_cast<std::size_t>(TokenType::EOF_) + 1;
+
+struct ParseTable {
+    ParseRule rules[TOKEN_TYPE_COUNT];
 };
-// clang-format on
 
-ParseRule Parser::getRule(TokenType type) { return rules[type]; }
+static constexpr ParseTable makeParseTable() {
+    ParseTable table{};
+    auto rule = [&table](TokenType type, ParseFn prefix, ParseFn infix,
+                         Precedence precedence) {
+        table.rules[static_cast<std::size_t>(type)] = {prefix, infix,
+                                                       precedence};
+    };
+    // clang-format off
+    rule(TokenType::LEFT_PAREN,    &Compiler::grouping, &Compiler::call,   Precedence::CALL);
+    rule(TokenType::MINUS,         &Compiler::unary,    &Compiler::binary, Precedence::TERM);
+    rule(TokenType::PLUS,          nullptr,             &Compiler::binary, Precedence::TERM);
+    rule(TokenType::SLASH,         nullptr,             &Compiler::binary, Precedence::FACTOR);
+    rule(TokenType::STAR,          nullptr,             &Compiler::binary, Precedence::FACTOR);
+    rule(TokenType::NUMBER,        &Compiler::number,   nullptr,           Precedence::NONE);
+    rule(TokenType::STRING,        &Compiler::string,   nullptr,           Precedence::NONE);
+    rule(TokenType::NIL,           &Compiler::literal,  nullptr,           Precedence::NONE);
+    rule(TokenType::TRUE,          &Compiler::literal,  nullptr,           Precedence::NONE);
+    rule(TokenType::FALSE,         &Compiler::literal,  nullptr,           Precedence::NONE);
+    rule(TokenType::BANG,          &Compiler::unary,    nullptr,           Precedence::NONE);
+    rule(TokenType::BANG_EQUAL,    nullptr,             &Compiler::binary, Precedence::EQUALITY);
+    rule(TokenType::EQUAL_EQUAL,   nullptr,             &Compiler::binary, Precedence::EQUALITY);
+    rule(TokenType::GREATER,       nullptr,             &Compiler::binary, Precedence::COMPARISON);
+    rule(TokenType::GREATER_EQUAL, nullptr,             &Compiler::binary, Precedence::COMPARISON);
+    rule(TokenType::LESS,          nullptr,             &Compiler::binary, Precedence::COMPARISON);
+    rule(TokenType::LESS_EQUAL,    nullptr,             &Compiler::binary, Precedence::COMPARISON);
+    rule(TokenType::IDENTIFIER,    &Compiler::variable, nullptr,           Precedence::NONE);
+    rule(TokenType::AND,           nullptr,             &Compiler::andOp,  Precedence::AND);
+    rule(TokenType::OR,            nullptr,             &Compiler::orOp,   Precedence::OR);
+    // clang-format on
+    return table;
+}
+
+// indexed by TokenType; tokens without a rule have neither function
+static constexpr ParseTable PARSE_TABLE = makeParseTable();
 
-PrattParser::PrattParser(const std::string &source)
-    : scanner(Scanner(source)), current(scanner.scanOneToken()),
-      previous(current), hadError(false), panicMode(false){};
+const ParseRule &Parser::getRule(TokenType type) {
+    return PARSE_TABLE.rules[static_cast<std::size_t>(type)];
+}
+
+PrattParser::PrattParser(const TokenStream &tokens)
+    : tokens(tokens), current(this->tokens.next()),
+      previous(current), hadError(false), panicMode(false),
+      wideJumps(false), needsWideJumps(false), lazySource(nullptr),
+      errors(stderr){};
 
 void Parser::errorAt(const Token &token, const char *message) {
     if (panicMode)
         return;
     panicMode = true;
 
-    std::fprintf(stderr, "[line %d] Error", token.line);
+    std::fprintf(errors, "[line %d] Error", token.line);
     if (token.type == TokenType::EOF_) {
-        std::fprintf(stderr, " at end");
+        std::fprintf(errors, " at end");
     } else if (token.type == TokenType::ERROR) {
         // do nothing
     } else {
-        std::fprintf(stderr, ": at '%.*s'",
+        std::fprintf(errors, " at '%.*s'",
                      static_cast<int>(token.lexeme.length()),
                      token.lexeme.data());
     }
-    std::fprintf(stderr, ": %s\n", message);
+    std::fprintf(errors, ": %s\n", message);
 
     hadError = true;
 }
@@ -72,7 +94,7 @@ void Parser::advance() {
     previous = current;
 
     for (;;) {
-        current = scanner.scanOneToken();
+        current = tokens.next();
         if (current.type != TokenType::ERROR)
             break;
 
@@ -121,6 +143,7 @@ void Parser::synchronize() {
 }
 
 void Parser::parsePrecedence(Precedence precedence, Compiler &compiler) {
+    int start = compiler.currentChunk()->count;
     advance();
     ParseFn prefixRule = getRule(previous.type).prefix;
     if (!prefixRule) {
@@ -128,11 +151,12 @@ void Parser::parsePrecedence(Precedence precedence, Compiler &compiler) {
         return;
     }
     bool canAssign = precedence <= Precedence::ASSIGNMENT;
-    prefixRule(compiler, canAssign);
+    (compiler.*prefixRule)(canAssign);
     while (precedence <= getRule(current.type).precedence) {
         advance();
         ParseFn infixRule = getRule(previous.type).infix;
-        infixRule(compiler, canAssign);
+        compiler.leftOperandStart = start;
+        (compiler.*infixRule)(canAssign);
     }
 
     if (canAssign && match(TokenType::EQUAL)) {
@@ -140,8 +164,50 @@ void Parser::parsePrecedence(Precedence precedence, Compiler &compiler) {
     }
 }
 
-ObjFunction *SinglePassCompiler::compile(const std::string &source) {
-    parser = std::make_unique<Parser>(source);
+ObjFunction *SinglePassCompiler::compile(std::string_view source,
+                                         bool lazy, std::FILE *errors) {
+    // lazy bodies are parsed again after `source` may be gone, so they
+    // share a copy of it
+    std::shared_ptr<const std::string> lazySource =
+        lazy ? std::make_shared<const std::string>(source) : nullptr;
+    std::string_view text = lazy ? *lazySource : source;
+    TokenStream tokens = TokenStream::forSource(text);
+
+    SinglePassCompiler compiler(errors);
+    ObjFunction *function =
+        compiler.compilePass(tokens, /*wideJumps=*/false, lazySource);
+    if (!function && compiler.parser->needsWideJumps &&
+        !compiler.parser->hadError) {
+        // Some forward jump didn't fit in 16 bits. That only happens with
+        // huge generated bodies, so just compile again with wide jumps.
+        function =
+            compiler.compilePass(tokens, /*wideJumps=*/true, lazySource);
+    }
+    return function;
+}
+
+bool SinglePassCompiler::compileLazy(ObjFunction *function,
+                                     std::FILE *errors) {
+    std::unique_ptr<LazyBody> body = std::move(function->lazyBody);
+    SinglePassCompiler compiler(errors);
+    bool compiled =
+        compiler.compileLazyPass(function, *body, /*wideJumps=*/false);
+    if (!compiled && compiler.parser->needsWideJumps &&
+        !compiler.parser->hadError) {
+        function->chunk.clear();
+        compiled =
+            compiler.compileLazyPass(function, *body, /*wideJumps=*/true);
+    }
+    return compiled;
+}
+
+ObjFunction *
+SinglePassCompiler::compilePass(const TokenStream &tokens, bool wideJumps,
+                                std::shared_ptr<const std::string> lazySource) {
+    parser = std::make_unique<Parser>(tokens);
+    parser->wideJumps = wideJumps;
+    parser->lazySource = std::move(lazySource);
+    parser->errors = errors;
     current =
         std::make_unique<Compiler>(FunctionType::SCRIPT, /*enclosing=*/nullptr);
 
@@ -153,20 +219,122 @@ ObjFunction *SinglePassCompiler::compile(const std::string &source) {
     }
 
     auto *function = current->endCompiler();
-    return parser->hadError ? nullptr : function;
+    return parser->hadError || parser->needsWideJumps ? nullptr : function;
 }
 
-Compiler::Compiler(FunctionType type, Compiler *enclosing)
-    : compilingFunction(nullptr), type(type), localCount(0), scopeDepth(0),
-      parser(nullptr), enclosing(enclosing) {
-    compilingFunction = Allocator::create<ObjFunction>();
+bool SinglePassCompiler::compileLazyPass(ObjFunction *function,
+                                         const LazyBody &body, bool wideJumps) {
+    parser = std::make_unique<Parser>(
+        TokenStream(*body.source, body.offset, body.line));
+    parser->wideJumps = wideJumps;
+    parser->errors = errors;
+    // counted again while parsing the parameters
+    function->arity = 0;
+    current = std::make_unique<Compiler>(FunctionType::FUNCTION,
+                                         /*enclosing=*/nullptr, function);
+    current->parser = parser.get();
+
+    current->functionBody();
+    return !parser->hadError && !parser->needsWideJumps;
+}
+
+// up to how many constants or locals are scanned instead of hashed
+static constexpr std::size_t SCAN_LIMIT = 8;
+
+static uint32_t hashName(std::string_view name) {
+    /* FNV-1a hash function impl */
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+int &ConstantIndex::find(std::string_view text) {
+    return find(Kind::STRING, hashName(text), text);
+}
+
+int &ConstantIndex::find(Integer value) {
+    return find(Kind::INTEGER, static_cast<uint64_t>(value), {});
+}
+
+int &ConstantIndex::find(Number value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return find(Kind::NUMBER, bits, {});
+}
+
+// numbers are mostly small, so spread their bits over the whole table
+static uint32_t hashBits(uint64_t bits) {
+    return static_cast<uint32_t>((bits * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+int &ConstantIndex::find(Kind kind, uint64_t bits, std::string_view text) {
+    auto matches = [&](const Key &key) {
+        return key.bits == bits && key.kind == kind && key.text == text;
+    };
+
+    if (slots.empty()) {
+        if (keys.empty())
+            keys.reserve(SCAN_LIMIT + 1);
+        for (Key &key : keys) {
+            if (matches(key))
+                return key.constant;
+        }
+        keys.push_back({bits, text, kind, -1});
+        if (keys.size() > SCAN_LIMIT)
+            rehash(4 * SCAN_LIMIT);
+        return keys.back().constant;
+    }
+
+    uint32_t hash = hashBits(bits);
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+        Slot &slot = slots[i];
+        if (slot.key == 0) {
+            keys.push_back({bits, text, kind, -1});
+            slot = {hash, static_cast<int>(keys.size())};
+            // keep at most 3/4 of the slots in use
+            if (4 * keys.size() > 3 * slots.size())
+                rehash(2 * slots.size());
+            return keys.back().constant;
+        }
+        if (slot.hash == hash && matches(keys[slot.key - 1]))
+            return keys[slot.key - 1].constant;
+    }
+}
+
+void ConstantIndex::rehash(std::size_t size) {
+    slots.assign(size, {});
+    std::size_t mask = size - 1;
+    for (std::size_t key = 0; key < keys.size(); key++) {
+        uint32_t hash = hashBits(keys[key].bits);
+        std::size_t i = hash & mask;
+        while (slots[i].key != 0)
+            i = (i + 1) & mask;
+        slots[i] = {hash, static_cast<int>(key + 1)};
+    }
+}
+
+Compiler::Compiler(FunctionType type, Compiler *enclosing,
+                   ObjFunction *function)
+    : compilingFunction(function), type(type), localCount(0),
+      localsIndexed(false), scopeDepth(0),
+      parser(nullptr), enclosing(enclosing), checkOnly(false),
+      checkedConstants(0), leftOperandStart(0),
+      lastComparison({TokenType::EOF_, 0, 0, 0, -1}), lastJumpTarget(0) {
+    if (!compilingFunction)
+        compilingFunction = Allocator::create<ObjFunction>();
 
     // access parser from enclosing compiler
     if (enclosing) {
         parser = enclosing->parser;
+        checkOnly = enclosing->checkOnly;
     }
 
-    if (type != FunctionType::SCRIPT) {
+    if (type != FunctionType::SCRIPT && !compilingFunction->name &&
+        !checkOnly) {
         assert(enclosing); // should have an enclosing compiler
         compilingFunction->name = ObjString::copy(parser->previous.lexeme);
     }
@@ -175,7 +343,9 @@ Compiler::Compiler(FunctionType type, Compiler *enclosing)
     Local *local = &locals[localCount++];
     local->name.lexeme = "";
     local->depth = 0;
-    local->isCaptured = false;
+    local->isAssigned = false;
+    local->capture = CaptureMode::NONE;
+    local->shadowed = -1;
 }
 
 void Compiler::declaration() {
@@ -191,7 +361,7 @@ void Compiler::declaration() {
 }
 
 void Compiler::varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (parser->match(TokenType::EQUAL)) {
         expression();
@@ -205,7 +375,7 @@ void Compiler::varDeclaration() {
 }
 
 void Compiler::funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(FunctionType::FUNCTION);
     defineVariable(global);
@@ -261,13 +431,16 @@ void Compiler::ifStatement() {
     expression();
     parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int thenJump = emitConditionJump(fused);
+    if (!fused)
+        emitByte(OP_POP);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
     patchJump(thenJump);
-    emitByte(OP_POP);
+    if (!fused)
+        emitByte(OP_POP);
 
     if (parser->match(TokenType::ELSE))
         statement();
@@ -281,13 +454,16 @@ void Compiler::whileStatement() {
     expression();
     parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int exitJump = emitConditionJump(fused);
+    if (!fused)
+        emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
+    if (!fused)
+        emitByte(OP_POP);
 }
 
 void Compiler::forStatement() {
@@ -305,6 +481,7 @@ void Compiler::forStatement() {
 
     int loopStart = currentChunk()->count;
     int exitJump = -1;
+    bool fused = false;
 
     // 2. condition
     if (!parser->match(TokenType::SEMICOLON)) {
@@ -312,8 +489,9 @@ void Compiler::forStatement() {
         parser->consume(TokenType::SEMICOLON,
                         "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitConditionJump(fused);
+        if (!fused)
+            emitByte(OP_POP);
     }
 
     // 3. increment
@@ -336,7 +514,8 @@ void Compiler::forStatement() {
 
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP);
+        if (!fused)
+            emitByte(OP_POP);
     }
     endScope();
 }
@@ -386,9 +565,12 @@ void Compiler::unary(bool /*canAssign*/) {
 
 void Compiler::binary(bool /*canAssign*/) {
     TokenType operatorType = parser->previous.type;
-    ParseRule rule = parser->getRule(operatorType);
+    int leftStart = leftOperandStart;
+    int rightStart = currentChunk()->count;
+    const ParseRule &rule = parser->getRule(operatorType);
     auto nextPrec = static_cast<int>(rule.precedence) + 1;
     parser->parsePrecedence(static_cast<Precedence>(nextPrec), *this);
+    int compareStart = currentChunk()->count;
 
     switch (operatorType) {
     case TokenType::BANG_EQUAL:
@@ -424,6 +606,12 @@ void Compiler::binary(bool /*canAssign*/) {
     default:
         return;
     }
+
+    if (rule.precedence == Precedence::EQUALITY ||
+        rule.precedence == Precedence::COMPARISON) {
+        lastComparison = {operatorType, leftStart, rightStart, compareStart,
+                          currentChunk()->count};
+    }
 }
 
 void Compiler::andOp(bool /*canAssign*/) {
@@ -445,12 +633,38 @@ void Compiler::orOp(bool /*canAssign*/) {
 }
 
 void Compiler::number(bool /*canAssign*/) {
-    Number value = std::strtod(parser->previous.lexeme.data(), nullptr);
-    emitConstant(value);
+    std::string_view lexeme = parser->previous.lexeme;
+
+    // up to 15 digits an integer is always exact, so add up its digits
+    if (lexeme.size() <= 15 && lexeme.find('.') == std::string_view::npos) {
+        Integer value = 0;
+        for (char digit : lexeme)
+            value = value * 10 + (digit - '0');
+        emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, numberConstant(value));
+        return;
+    }
+
+    Number value;
+    auto [end, error] = std::from_chars(
+        lexeme.data(), lexeme.data() + lexeme.size(), value);
+    if (error == std::errc::result_out_of_range) {
+        // round to infinity or zero, as strtod did: without an exponent a
+        // literal only underflows if its integer part is zero
+        auto integral = lexeme.substr(0, lexeme.find('.'));
+        bool zero = integral.find_first_not_of('0') == std::string_view::npos;
+        value = zero ? 0.0 : std::numeric_limits<Number>::infinity();
+    }
+    // literals are never negative, so never -0
+    int constant =
+        value <= INTEGER_MAX && value == static_cast<Integer>(value)
+            ? numberConstant(static_cast<Integer>(value))
+            : numberConstant(value);
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, constant);
 }
 
 void Compiler::string(bool /*canAssign*/) {
-    emitConstant(ObjString::copy(parser->previous.lexeme));
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG,
+                stringConstant(parser->previous.lexeme));
 }
 
 void Compiler::literal(bool /*canAssign*/) {
@@ -477,13 +691,30 @@ void Compiler::endScope() {
     scopeDepth--;
 
     while (localCount > 0 && locals[localCount - 1].depth > scopeDepth) {
-        if (locals[localCount - 1].isCaptured) {
+        const Local &local = locals[localCount - 1];
+        if (local.capture == CaptureMode::BY_REFERENCE) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
         }
+
+        // Uncover the local this one shadowed, if any. A name only leaves
+        // the table after every local declared since it, so no probe ever
+        // has to step over the emptied slot.
+        if (localsIndexed) {
+            localSlot(local.name.lexeme) =
+                local.shadowed == -1 ? 0 : static_cast<uint8_t>(local.shadowed);
+        }
         localCount--;
     }
+
+    // whatever is still captured by value out of scope stays that way
+    captureSites.erase(
+        std::remove_if(captureSites.begin(), captureSites.end(),
+                       [&](const CaptureSite &site) {
+                           return site.local >= localCount;
+                       }),
+        captureSites.end());
 }
 
 int Compiler::resolveUpvalue(const Token &name) {
@@ -492,49 +723,106 @@ int Compiler::resolveUpvalue(const Token &name) {
 
     int local = enclosing->resolveLocal(name);
     if (local != -1) {
-        enclosing->locals[local].isCaptured = true;
-        return addUpvalue(static_cast<uint8_t>(local), true);
+        enclosing->captureLocal(local);
+        auto slot = static_cast<uint8_t>(local);
+        return addUpvalue(slot, true, enclosing, slot);
     }
 
     int upvalue = enclosing->resolveUpvalue(name);
     if (upvalue != -1) {
-        return addUpvalue(static_cast<uint8_t>(upvalue), false);
+        // an upvalue of an upvalue is captured the way the original local is
+        const Upvalue &captured = enclosing->upvalues[upvalue];
+        return addUpvalue(static_cast<uint8_t>(upvalue), false, captured.owner,
+                          captured.local);
     }
 
     return -1;
 }
 
+bool Upvalue::byValue() const {
+    return owner->locals[local].capture == CaptureMode::BY_VALUE;
+}
+
+// A local is captured by value unless it has been assigned by the time it
+// is first captured. Should an assignment come later, `markAssigned` turns
+// every capture and read of it compiled so far into one by reference.
+void Compiler::captureLocal(int local) {
+    Local &captured = locals[local];
+    if (captured.capture == CaptureMode::NONE) {
+        captured.capture = captured.isAssigned ? CaptureMode::BY_REFERENCE
+                                               : CaptureMode::BY_VALUE;
+    }
+}
+
+void Compiler::markAssigned(int local) {
+    Local &assigned = locals[local];
+    assigned.isAssigned = true;
+    if (assigned.capture != CaptureMode::BY_VALUE)
+        return;
+
+    assigned.capture = CaptureMode::BY_REFERENCE;
+    auto isPatched = [&](const CaptureSite &site) {
+        if (site.local != local)
+            return false;
+        site.chunk->code[site.offset] = site.byReference;
+        return true;
+    };
+    captureSites.erase(std::remove_if(captureSites.begin(),
+                                      captureSites.end(), isPatched),
+                       captureSites.end());
+}
+
 int Compiler::resolveLocal(const Token &name) {
-    for (int i = localCount - 1; i >= 0; i--) {
-        Local *local = &locals[i];
-        if (name.lexeme == local->name.lexeme) {
-            if (local->depth == -1) {
-                parser->error(
-                    "Can't read local variable in its own initializer.");
-            }
+    int local = findLocal(name.lexeme);
+    if (local == 0)
+        return -1;
+
+    if (locals[local].depth == -1)
+        parser->error("Can't read local variable in its own initializer.");
+    return local;
+}
 
+// the innermost local called `name`, or 0, which is never named
+int Compiler::findLocal(std::string_view name) {
+    if (localsIndexed)
+        return localSlot(name);
+
+    for (int i = localCount - 1; i > 0; i--) {
+        if (locals[i].name.lexeme == name)
             return i;
-        }
     }
-    return -1;
+    return 0;
+}
+
+// the slot of `localSlots` holding the innermost local called `name`, or
+// the empty one where it would go; slot 0 of the stack is never there
+uint8_t &Compiler::localSlot(std::string_view name) {
+    constexpr uint32_t mask = 2 * UINT8_COUNT - 1;
+    for (uint32_t i = hashName(name) & mask;; i = (i + 1) & mask) {
+        uint8_t local = localSlots[i];
+        if (local == 0 || locals[local].name.lexeme == name)
+            return localSlots[i];
+    }
 }
 
-int Compiler::addUpvalue(uint8_t index, bool isLocal) {
+int Compiler::addUpvalue(uint8_t index, bool isLocal, Compiler *owner,
+                         uint8_t local) {
     int upvalueCount = compilingFunction->upvalueCount;
+    // most functions capture nothing, so only clear the slots when needed
+    if (upvalueCount == 0)
+        std::memset(upvalueSlots, 0, sizeof(upvalueSlots));
 
-    for (int i = 0; i < upvalueCount; i++) {
-        Upvalue *upvalue = &upvalues[i];
-        if (upvalue->index == index && upvalue->isLocal == isLocal) {
-            return i;
-        }
-    }
+    uint16_t &slot = upvalueSlots[isLocal][index];
+    if (slot != 0)
+        return slot - 1;
 
     if (upvalueCount == UINT8_COUNT) {
         parser->error("Too many closure variables in function.");
         return 0;
     }
 
-    upvalues[upvalueCount] = {index, isLocal};
+    upvalues[upvalueCount] = {index, isLocal, owner, local};
+    slot = static_cast<uint16_t>(upvalueCount + 1);
     return compilingFunction->upvalueCount++;
 }
 
@@ -544,8 +832,25 @@ void Compiler::addLocal(const Token &name) {
         return;
     }
 
-    Local *local = &locals[localCount++];
-    *local = {name, -1, false};
+    int index = localCount++;
+    locals[index] = {name, -1, false, CaptureMode::NONE, -1};
+    if (localsIndexed) {
+        uint8_t &innermost = localSlot(name.lexeme);
+        locals[index].shadowed = innermost == 0 ? -1 : innermost;
+        innermost = static_cast<uint8_t>(index);
+    } else if (static_cast<std::size_t>(localCount) > SCAN_LIMIT) {
+        indexLocals();
+    }
+}
+
+void Compiler::indexLocals() {
+    std::memset(localSlots, 0, sizeof(localSlots));
+    localsIndexed = true;
+    for (int i = 1; i < localCount; i++) {
+        uint8_t &innermost = localSlot(locals[i].name.lexeme);
+        locals[i].shadowed = innermost == 0 ? -1 : innermost;
+        innermost = static_cast<uint8_t>(i);
+    }
 }
 
 void Compiler::markInitialized() {
@@ -555,39 +860,87 @@ void Compiler::markInitialized() {
 }
 
 void Compiler::function(FunctionType type) {
-    Compiler funCompiler = Compiler(type, this);
-    Parser *funParser = funCompiler.parser;
-    ObjFunction *currFunction = funCompiler.compilingFunction;
-
-    funCompiler.beginScope();
-    funParser->consume(TokenType::LEFT_PAREN,
-                       "Expect '(' after function name.");
-    if (!funParser->check(TokenType::RIGHT_PAREN)) {
-        do {
-            currFunction->arity++;
-            if (currFunction->arity > 255) {
-                funParser->errorAtCurrent(
-                    "Can't have more than 255 parameters.");
-            }
+    if (parser->lazySource && this->type == FunctionType::SCRIPT &&
+        scopeDepth == 0) {
+        lazyFunction(type);
+        return;
+    }
+
+    // a checked body is thrown away, so it needn't live on the heap
+    ObjFunction scratch;
+    Compiler funCompiler(type, this, checkOnly ? &scratch : nullptr);
+    ObjFunction *currFunction = funCompiler.functionBody();
 
-            uint8_t constant =
-                funCompiler.parseVariable("Expect parameter name.");
-            funCompiler.defineVariable(constant);
-        } while (funParser->match(TokenType::COMMA));
+    if (checkOnly) {
+        makeConstant(Nil{});
+        return;
     }
-    funParser->consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
-    funParser->consume(TokenType::LEFT_BRACE,
-                       "Expect '{' before function body.");
-    funCompiler.block();
-    currFunction = funCompiler.endCompiler();
 
-    this->emitBytes(OP_CLOSURE, this->makeConstant(currFunction));
+    if (currFunction->upvalueCount == 0) {
+        // nothing to capture, so every evaluation of this declaration can
+        // share one closure created up front instead of allocating anew
+        emitConstant(Allocator::create<ObjClosure>(currFunction));
+        return;
+    }
+
+    emitIndexed(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(currFunction));
     for (int i = 0; i < currFunction->upvalueCount; i++) {
-        emitByte(funCompiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(funCompiler.upvalues[i].index);
+        const Upvalue &upvalue = funCompiler.upvalues[i];
+        if (!upvalue.isLocal) {
+            emitByte(CAPTURE_UPVALUE);
+        } else if (upvalue.byValue()) {
+            emitByte(CAPTURE_LOCAL_VALUE);
+            captureSites.push_back({upvalue.index, currentChunk(),
+                                    currentChunk()->count - 1, CAPTURE_LOCAL});
+        } else {
+            emitByte(CAPTURE_LOCAL);
+        }
+        emitByte(upvalue.index);
     }
 }
 
+// A top-level function can't capture anything, so its body can be compiled
+// on its own once it's called. It's still parsed now, so that errors are
+// reported exactly as if it were compiled eagerly.
+void Compiler::lazyFunction(FunctionType type) {
+    ObjFunction *function = Allocator::create<ObjFunction>();
+    function->name = ObjString::copy(parser->previous.lexeme);
+    auto body = std::make_unique<LazyBody>(LazyBody{
+        parser->lazySource,
+        static_cast<std::size_t>(parser->current.lexeme.data() -
+                                 parser->lazySource->data()),
+        parser->current.line});
+
+    Compiler checker(type, this, function);
+    checker.checkOnly = true;
+    checker.functionBody();
+    function->lazyBody = std::move(body);
+
+    emitConstant(Allocator::create<ObjClosure>(function));
+}
+
+ObjFunction *Compiler::functionBody() {
+    ObjFunction *function = compilingFunction;
+
+    beginScope();
+    parser->consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    if (!parser->check(TokenType::RIGHT_PAREN)) {
+        do {
+            function->arity++;
+            if (function->arity > 255) {
+                parser->errorAtCurrent("Can't have more than 255 parameters.");
+            }
+
+            int constant = parseVariable("Expect parameter name.");
+            defineVariable(constant);
+        } while (parser->match(TokenType::COMMA));
+    }
+    parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+    parser->consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
+    block();
+    return endCompiler();
+}
+
 uint8_t Compiler::argumentList() {
     uint8_t argCount = 0;
     if (!parser->check(TokenType::RIGHT_PAREN)) {
@@ -603,7 +956,7 @@ uint8_t Compiler::argumentList() {
     return argCount;
 }
 
-uint8_t Compiler::parseVariable(const char *errorMessage) {
+int Compiler::parseVariable(const char *errorMessage) {
     parser->consume(TokenType::IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -613,8 +966,26 @@ uint8_t Compiler::parseVariable(const char *errorMessage) {
     return identifierConstant(parser->previous);
 }
 
-uint8_t Compiler::identifierConstant(const Token &name) {
-    return makeConstant(ObjString::copy(name.lexeme));
+int Compiler::identifierConstant(const Token &name) {
+    return stringConstant(name.lexeme);
+}
+
+int Compiler::stringConstant(std::string_view text) {
+    int &constant = constants.find(text);
+    if (constant == -1) {
+        constant = checkOnly ? makeConstant(Nil{})
+                             : makeConstant(ObjString::copy(text));
+    }
+    return constant;
+}
+
+int Compiler::numberConstant(Value value) {
+    int &constant = value.isType<Integer>()
+                        ? constants.find(value.asType<Integer>())
+                        : constants.find(value.asType<Number>());
+    if (constant == -1)
+        constant = makeConstant(value);
+    return constant;
 }
 
 void Compiler::declareVariable() {
@@ -622,62 +993,77 @@ void Compiler::declareVariable() {
         return;
 
     const Token &name = parser->previous;
-    for (int i = localCount - 1; i >= 0; i--) {
-        Local *local = &locals[i];
-        if (local->depth != -1 && local->depth < scopeDepth) {
-            break;
-        }
-        if (name.lexeme == local->name.lexeme) {
-            parser->error("Already a variable with this name in this scope.");
-        }
+    int innermost = findLocal(name.lexeme);
+    if (innermost != 0 && (locals[innermost].depth == -1 ||
+                           locals[innermost].depth >= scopeDepth)) {
+        parser->error("Already a variable with this name in this scope.");
     }
 
     addLocal(name);
 }
 
-void Compiler::defineVariable(uint8_t global) {
+void Compiler::defineVariable(int global) {
     if (scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 void Compiler::namedVariable(const Token &name, bool canAssign) {
-    uint8_t getOp, setOp;
+    // locals and upvalues are at most 255, so their long forms never apply
+    uint8_t getOp, setOp, getLongOp, setLongOp;
     int arg = resolveLocal(name);
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+        getOp = getLongOp = OP_GET_LOCAL;
+        setOp = setLongOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        getOp = getLongOp =
+            upvalues[arg].byValue() ? OP_GET_FLAT_UPVALUE : OP_GET_UPVALUE;
+        setOp = setLongOp = OP_SET_UPVALUE;
     } else {
         arg = identifierConstant(name);
         getOp = OP_GET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
         setOp = OP_SET_GLOBAL;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
     if (parser->match(TokenType::EQUAL) && canAssign) {
+        if (setOp == OP_SET_LOCAL) {
+            markAssigned(arg);
+        } else if (setOp == OP_SET_UPVALUE) {
+            upvalues[arg].owner->markAssigned(upvalues[arg].local);
+        }
         expression();
-        emitBytes(setOp, static_cast<uint8_t>(arg));
+        emitIndexed(setOp, setLongOp, arg);
     } else {
-        emitBytes(getOp, static_cast<uint8_t>(arg));
+        emitIndexed(getOp, getLongOp, arg);
+        if (getOp == OP_GET_FLAT_UPVALUE && !checkOnly) {
+            Chunk *chunk = currentChunk();
+            upvalues[arg].owner->captureSites.push_back(
+                {upvalues[arg].local, chunk, chunk->count - 2,
+                 OP_GET_UPVALUE});
+        }
     }
 }
 
-uint8_t Compiler::makeConstant(Value value) {
-    int constant = currentChunk()->addConstant(value);
-    if (constant > UINT8_MAX) {
+int Compiler::makeConstant(Value value) {
+    // a checked body only needs to know when it would run out of constants
+    int constant =
+        checkOnly ? checkedConstants++ : currentChunk()->addConstant(value);
+    if (constant > UINT24_MAX) {
         parser->error("Too many constants in one chunk.");
         return 0;
     }
 
-    return static_cast<uint8_t>(constant);
+    return constant;
 }
 
 void Compiler::emitByte(uint8_t byte) {
+    if (checkOnly)
+        return;
     currentChunk()->write(byte, parser->previous.line);
 }
 
@@ -686,34 +1072,184 @@ void Compiler::emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+void Compiler::emitIndexed(uint8_t instruction, uint8_t longInstruction,
+                           int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(instruction, static_cast<uint8_t>(index));
+        return;
+    }
+
+    emitByte(longInstruction);
+    emitByte((index >> 16) & 0xff);
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+}
+
 void Compiler::emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
-int Compiler::emitJump(uint8_t instruction) {
+int Compiler::emitJump(OpCode instruction) {
+    if (parser->wideJumps) {
+        emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+        emitByte(0xff);
+        emitBytes(0xff, 0xff);
+        return currentChunk()->count - 3;
+    }
+
     emitByte(instruction);
     emitBytes(0xff, 0xff);
     return currentChunk()->count - 2;
 }
 
 void Compiler::patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+    if (checkOnly)
+        return;
+
+    lastJumpTarget = currentChunk()->count;
+    uint8_t *code = currentChunk()->code;
+    // forward jumps are either all long or all short
+    bool isLong = parser->wideJumps;
+
+    if (!isLong) {
+        int jump = currentChunk()->count - offset - 2;
+        if (jump > UINT16_MAX) {
+            // not an error yet; the whole script gets compiled again
+            parser->needsWideJumps = true;
+            return;
+        }
+
+        code[offset] = (jump >> 8) & 0xff;
+        code[offset + 1] = jump & 0xff;
+        return;
+    }
 
-    if (jump > UINT16_MAX) {
+    int jump = currentChunk()->count - offset - 3;
+    if (jump > UINT24_MAX) {
         parser->error("Too many code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    code[offset] = (jump >> 16) & 0xff;
+    code[offset + 1] = (jump >> 8) & 0xff;
+    code[offset + 2] = jump & 0xff;
+}
+
+// the fused jump for each comparison, in its stack operand form
+static uint8_t compareJumpFor(TokenType comparison) {
+    switch (comparison) {
+    case TokenType::LESS:
+        return OP_JUMP_IF_NOT_LESS;
+    case TokenType::LESS_EQUAL:
+        return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case TokenType::GREATER:
+        return OP_JUMP_IF_NOT_GREATER;
+    case TokenType::GREATER_EQUAL:
+        return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case TokenType::EQUAL_EQUAL:
+        return OP_JUMP_IF_NOT_EQUAL;
+    default:
+        return OP_JUMP_IF_EQUAL;
+    }
+}
+
+// the comparison with its operands swapped, so `1 < i` can be `i > 1`
+static TokenType mirrorComparison(TokenType comparison) {
+    switch (comparison) {
+    case TokenType::LESS:
+        return TokenType::GREATER;
+    case TokenType::LESS_EQUAL:
+        return TokenType::GREATER_EQUAL;
+    case TokenType::GREATER:
+        return TokenType::LESS;
+    case TokenType::GREATER_EQUAL:
+        return TokenType::LESS_EQUAL;
+    default:
+        return comparison;
+    }
+}
+
+// Emit the jump taken when the condition just compiled is false. When the
+// condition ends in a comparison, the comparison is folded into the jump,
+// which then consumes the operands; otherwise the condition is left on the
+// stack and the caller pops it on both paths.
+int Compiler::emitConditionJump(bool &fused) {
+    Chunk *chunk = currentChunk();
+    Comparison comparison = lastComparison;
+    lastComparison.end = -1;
+
+    // only when nothing jumps into the code being rewritten
+    fused = !checkOnly && !parser->wideJumps &&
+            comparison.end == chunk->count &&
+            lastJumpTarget <= comparison.compareStart;
+    if (!fused)
+        return emitJump(OP_JUMP_IF_FALSE);
+
+    auto isSimple = [&](int start, int end, OpCode op) {
+        return end - start == 2 && chunk->code[start] == op;
+    };
+    int left = comparison.leftStart;
+    int right = comparison.rightStart;
+    int compare = comparison.compareStart;
+    TokenType type = comparison.type;
+    int line = chunk->getLine(compare);
+
+    // operands that are a local and a local or constant go in the
+    // instruction too, the local first
+    int form = 0; // how far from the stack form
+    int first = -1, second = -1;
+    if (lastJumpTarget <= left && isSimple(left, right, OP_GET_LOCAL)) {
+        if (isSimple(right, compare, OP_GET_LOCAL)) {
+            form = OP_JUMP_IF_NOT_LESS_LOCALS - OP_JUMP_IF_NOT_LESS;
+            first = left;
+            second = right;
+        } else if (isSimple(right, compare, OP_CONSTANT)) {
+            form = OP_JUMP_IF_NOT_LESS_LOCAL_CONST - OP_JUMP_IF_NOT_LESS;
+            first = left;
+            second = right;
+        }
+    } else if (lastJumpTarget <= left && isSimple(left, right, OP_CONSTANT) &&
+               isSimple(right, compare, OP_GET_LOCAL)) {
+        form = OP_JUMP_IF_NOT_LESS_LOCAL_CONST - OP_JUMP_IF_NOT_LESS;
+        first = right;
+        second = left;
+        type = mirrorComparison(type);
+    }
+
+    if (form == 0) {
+        chunk->truncate(compare);
+        chunk->write(compareJumpFor(type), line);
+    } else {
+        uint8_t firstOperand = chunk->code[first + 1];
+        uint8_t secondOperand = chunk->code[second + 1];
+        chunk->truncate(left);
+        chunk->write(compareJumpFor(type) + form, line);
+        chunk->write(firstOperand, line);
+        chunk->write(secondOperand, line);
+    }
+    chunk->write(0xff, line);
+    chunk->write(0xff, line);
+    return chunk->count - 2;
 }
 
 void Compiler::emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    if (checkOnly)
+        return;
+
+    // distance back from the end of the instruction to the loop start
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitByte((offset >> 8) & 0xff);
+        emitByte(offset & 0xff);
+        return;
+    }
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX)
+    offset++; // one more operand byte in the long form
+    if (offset > UINT24_MAX)
         parser->error("Loop body too large.");
 
+    emitByte(OP_LOOP_LONG);
+    emitByte((offset >> 16) & 0xff);
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
@@ -726,7 +1262,7 @@ void Compiler::emitReturn() {
 ObjFunction *Compiler::endCompiler() {
     emitReturn();
 #ifdef DEBUG_PRINT_CODE
-    if (!parser->hadError) {
+    if (!parser->hadError && !parser->needsWideJumps && !checkOnly) {
         disassembleChunk(&compilingFunction->chunk,
                          compilingFunction->getName());
     }
@@ -2,8 +2,11 @@
 #define CLOXPP_COMPILER_H
 
 #include <cstdint>
-#include <functional>
+#include <cstdio>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "object.hpp"
 #include "scanner.hpp"
@@ -26,7 +29,7 @@ enum class Precedence {
 };
 
 class Compiler;
-using ParseFn = std::function<void(Compiler &, bool)>;
+using ParseFn = void (Compiler::*)(bool canAssign);
 
 struct ParseRule {
     ParseFn prefix;
@@ -35,13 +38,18 @@ struct ParseRule {
 };
 
 struct PrattParser {
-    Scanner scanner;
+    TokenStream tokens;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    bool wideJumps; // emit every forward jump with a 24-bit operand
+    bool needsWideJumps;
+    // set when top-level function bodies are compiled on their first call
+    std::shared_ptr<const std::string> lazySource;
+    std::FILE *errors; // where errors are reported, stderr by default
 
-    PrattParser(const std::string &source);
+    explicit PrattParser(const TokenStream &tokens);
 
     void errorAt(const Token &token, const char *message);
     void errorAtCurrent(const char *message);
@@ -55,25 +63,91 @@ struct PrattParser {
 
     void parsePrecedence(Precedence precedence, Compiler &compiler);
 
-    static std::unordered_map<TokenType, ParseRule> rules;
-    static ParseRule getRule(TokenType type);
+    static const ParseRule &getRule(TokenType type);
 };
 using Parser = PrattParser;
 
+enum class CaptureMode {
+    NONE,
+    BY_VALUE,     // not reassigned so far, closures keep a copy of the value
+    BY_REFERENCE, // closures share an ObjUpvalue, closed at end of scope
+};
+
 struct Local {
     Token name;
     int depth;
-    bool isCaptured;
+    bool isAssigned;
+    CaptureMode capture;
+    int shadowed; // local of the same name it hides, once locals are hashed
 };
 
 struct Upvalue {
     uint8_t index;
     bool isLocal;
+    // the local this ends up capturing, through any enclosing upvalues
+    Compiler *owner;
+    uint8_t local;
+
+    bool byValue() const;
+};
+
+// A byte compiled for a local captured by value, and what it becomes if the
+// local is assigned later on after all
+struct CaptureSite {
+    int local;
+    Chunk *chunk;
+    int offset;
+    uint8_t byReference;
+};
+
+// Index of the constants already in a chunk, so that each name, string and
+// number is stored once. Strings are keyed by their text, which a checked
+// body has without creating them.
+class ConstantIndex {
+public:
+    // the constant's index, or -1 for a new key; only valid until the next
+    // lookup
+    int &find(std::string_view text);
+    int &find(Integer value);
+    int &find(Number value);
+
+private:
+    enum class Kind : uint8_t { STRING, INTEGER, NUMBER };
+    struct Key {
+        uint64_t bits; // of the number, or hash of the string
+        std::string_view text;
+        Kind kind;
+        int constant;
+    };
+    struct Slot {
+        uint32_t hash;
+        int key; // 1 + its index in `keys`, or 0 when empty
+    };
+
+    int &find(Kind kind, uint64_t bits, std::string_view text);
+    void rehash(std::size_t size);
+
+    std::vector<Key> keys;   // in the order they were added
+    // open addressing, a power of 2 long; empty while there are only a few
+    // keys, which are quicker to scan
+    std::vector<Slot> slots;
+};
+
+// where the code of the last comparison compiled lies, so that a condition
+// ending in it can fuse it with its jump
+struct Comparison {
+    TokenType type;
+    int leftStart;
+    int rightStart;
+    int compareStart;
+    int end;
 };
 
 class Compiler {
 public:
-    Compiler(FunctionType type, Compiler *enclosing);
+    // compiles into `function` when given, or a new ObjFunction otherwise
+    Compiler(FunctionType type, Compiler *enclosing,
+             ObjFunction *function = nullptr);
 
     void variable(bool canAssign);
     void string(bool canAssign);
@@ -107,24 +181,36 @@ private:
 
     int resolveUpvalue(const Token &name);
     int resolveLocal(const Token &name);
-    int addUpvalue(uint8_t index, bool isLocal);
+    int findLocal(std::string_view name);
+    uint8_t &localSlot(std::string_view name);
+    void indexLocals();
+    int addUpvalue(uint8_t index, bool isLocal, Compiler *owner,
+                   uint8_t local);
+    void captureLocal(int local);
+    void markAssigned(int local);
     void addLocal(const Token &name);
     void markInitialized();
 
     void function(FunctionType type);
+    void lazyFunction(FunctionType type);
+    ObjFunction *functionBody();
     uint8_t argumentList();
 
-    uint8_t parseVariable(const char *errorMessage);
-    uint8_t identifierConstant(const Token &name);
+    int parseVariable(const char *errorMessage);
+    int identifierConstant(const Token &name);
+    int stringConstant(std::string_view text);
+    int numberConstant(Value value);
     void declareVariable();
-    void defineVariable(uint8_t global);
+    void defineVariable(int global);
     void namedVariable(const Token &name, bool canAssign);
 
-    uint8_t makeConstant(Value value);
+    int makeConstant(Value value);
     void emitByte(uint8_t byte);
     void emitBytes(uint8_t byte1, uint8_t byte2);
+    void emitIndexed(uint8_t instruction, uint8_t longInstruction, int index);
     void emitConstant(Value value);
-    int emitJump(uint8_t instruction);
+    int emitJump(OpCode instruction);
+    int emitConditionJump(bool &fused);
     void patchJump(int offset);
     void emitLoop(int loopStart);
     void emitReturn();
@@ -134,21 +220,56 @@ private:
     FunctionType type;
     Local locals[UINT8_COUNT];
     int localCount;
+    // once there are more than a few locals, the innermost one of each
+    // name in scope, the rest chained by `shadowed`; open addressing on the
+    // name, 0 where empty
+    bool localsIndexed;
+    uint8_t localSlots[2 * UINT8_COUNT];
     Upvalue upvalues[UINT8_COUNT];
+    // 1 + the upvalue capturing each [isLocal][index], 0 for none
+    uint16_t upvalueSlots[2][UINT8_COUNT];
+    // of the locals in scope that are captured by value
+    std::vector<CaptureSite> captureSites;
+    ConstantIndex constants;
     int scopeDepth;
     Parser *parser;
     Compiler *enclosing;
+    // only parse and resolve, reporting errors without emitting anything
+    bool checkOnly;
+    int checkedConstants;
+    int leftOperandStart; // set by the parser before each infix rule
+    Comparison lastComparison;
+    int lastJumpTarget;
 
+    friend struct PrattParser;
+    friend struct Upvalue;
     friend class SinglePassCompiler;
 };
 
+// Each compilation has a parser and compilers of its own, and creates its
+// objects in the heap entered on the calling thread, so threads can compile
+// at the same time.
 class SinglePassCompiler {
 public:
-    static ObjFunction *compile(const std::string &source);
+    // with `lazy`, top-level functions are only checked for errors here,
+    // and get their bytecode from `compileLazy` when first called; errors
+    // are reported on `errors`
+    static ObjFunction *compile(std::string_view source, bool lazy = false,
+                                std::FILE *errors = stderr);
+    static bool compileLazy(ObjFunction *function,
+                            std::FILE *errors = stderr);
 
 private:
-    static std::unique_ptr<Parser> parser;
-    static std::unique_ptr<Compiler> current;
+    explicit SinglePassCompiler(std::FILE *errors) : errors(errors) {}
+
+    ObjFunction *compilePass(const TokenStream &tokens, bool wideJumps,
+                             std::shared_ptr<const std::string> lazySource);
+    bool compileLazyPass(ObjFunction *function, const LazyBody &body,
+                         bool wideJumps);
+
+    std::FILE *errors;
+    std::unique_ptr<Parser> parser;
+    std::unique_ptr<Compiler> current;
 };
 
 } // namespace Clox
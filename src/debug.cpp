@@ -25,6 +25,18 @@ static int constantInstruction(const char *name, const Chunk *chunk,
     return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, const Chunk *chunk,
+                                   int offset) {
+    int constant = (chunk->code[offset + 1] << 16) |
+                   (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+
+    std::printf("%-16s %4d '", name, constant);
+    std::cout << chunk->constants.values[constant];
+    std::printf("'\n");
+
+    return offset + 4;
+}
+
 static int simpleInstruction(const char *name, int offset) {
     std::printf("%s\n", name);
     return offset + 1;
@@ -44,18 +56,47 @@ static int jumpInstruction(const char *name, int sign, const Chunk *chunk,
     return offset + 3;
 }
 
+static int jumpLongInstruction(const char *name, int sign, const Chunk *chunk,
+                               int offset) {
+    int jump = (chunk->code[offset + 1] << 16) |
+               (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    std::printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+// a local slot, then another slot or a constant, then a forward jump
+static int compareJumpInstruction(const char *name, bool withConstant,
+                                  const Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t operand = chunk->code[offset + 2];
+    auto jump = static_cast<uint16_t>(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+
+    std::printf("%-16s %4d ", name, slot);
+    if (withConstant) {
+        std::cout << "'" << chunk->constants.values[operand] << "'";
+    } else {
+        std::printf("%d", operand);
+    }
+    std::printf(" %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 int disassembleInstruction(const Chunk *chunk, int offset) {
     std::printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = chunk->getLine(offset);
+    if (offset > 0 && line == chunk->getLine(offset - 1)) {
         std::printf("   | ");
     } else {
-        std::printf("%4d ", chunk->lines[offset]);
+        std::printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -70,14 +111,22 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
         return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
         return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:
         return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_FLAT_UPVALUE:
+        return byteInstruction("OP_GET_FLAT_UPVALUE", chunk, offset);
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -100,26 +149,92 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
         return simpleInstruction("OP_PRINT", offset);
     case OP_JUMP:
         return jumpInstruction("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_LONG:
+        return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+        return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCALS", false,
+                                      chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCAL_CONST", true,
+                                      chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS", false,
+                                      chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST",
+                                      true, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER_LOCALS", false,
+                                      chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_LOCAL_CONST:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER_LOCAL_CONST",
+                                      true, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk,
+                               offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS",
+                                      false, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST:
+        return compareJumpInstruction(
+            "OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST", true, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_EQUAL_LOCALS", false,
+                                      chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST:
+        return compareJumpInstruction("OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST", true,
+                                      chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL_LOCALS:
+        return compareJumpInstruction("OP_JUMP_IF_EQUAL_LOCALS", false, chunk,
+                                      offset);
+    case OP_JUMP_IF_EQUAL_LOCAL_CONST:
+        return compareJumpInstruction("OP_JUMP_IF_EQUAL_LOCAL_CONST", true,
+                                      chunk, offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_LOOP_LONG:
+        return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
-    case OP_CLOSURE: {
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+        const char *name = "OP_CLOSURE";
+        int constant = chunk->code[++offset];
+        if (instruction == OP_CLOSURE_LONG) {
+            name = "OP_CLOSURE_LONG";
+            constant = (constant << 16) | (chunk->code[offset + 1] << 8) |
+                       chunk->code[offset + 2];
+            offset += 2;
+        }
         offset++;
-        uint8_t constant = chunk->code[offset++];
-        std::printf("%-16s %4d ", "OP_CLOSURE", constant);
+        std::printf("%-16s %4d ", name, constant);
         std::cout << chunk->constants.values[constant]; // this is ugly :(
         std::printf("\n");
 
         auto *function =
             chunk->constants.values[constant].asType<ObjFunction *>();
         for (int j = 0; j < function->getUpvalueCount(); j++) {
-            int isLocal = chunk->code[offset++];
+            int kind = chunk->code[offset++];
             int index = chunk->code[offset++];
+            const char *kindName = kind == CAPTURE_LOCAL         ? "local"
+                                   : kind == CAPTURE_LOCAL_VALUE ? "value"
+                                                                 : "upvalue";
             std::printf("%04d      |                     %s %d\n", offset - 2,
-                        isLocal ? "local" : "upvalue", index);
+                        kindName, index);
         }
 
         return offset;
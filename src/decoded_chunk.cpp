@@ -0,0 +1,143 @@
+#include <utility>
+
+#include "decoded_chunk.hpp"
+#include "object.hpp"
+
+namespace Clox {
+
+std::unique_ptr<DecodedChunk>
+DecodedChunk::decode(const Chunk &chunk, const void *const *handlers) {
+    auto decoded = std::make_unique<DecodedChunk>();
+    std::vector<Instruction> &code = decoded->code;
+
+    // jump targets are resolved once every instruction's index is known
+    std::vector<int> indexAt(chunk.count + 1, -1);
+    std::vector<std::pair<int, int>> jumps; // (instruction, target offset)
+
+    const uint8_t *bytes = chunk.code;
+    const Value *constants = chunk.constants.values;
+    auto readShort = [&](int at) { return (bytes[at] << 8) | bytes[at + 1]; };
+    auto readLong = [&](int at) {
+        return (bytes[at] << 16) | (bytes[at + 1] << 8) | bytes[at + 2];
+    };
+
+    for (int offset = 0; offset < chunk.count;) {
+        uint8_t op = bytes[offset];
+        Instruction instruction{handlers[op], {}, {}, nullptr, offset};
+        int length = 1;
+
+        switch (op) {
+        case OP_CONSTANT:
+            instruction.a.constant = &constants[bytes[offset + 1]];
+            length = 2;
+            break;
+        case OP_CONSTANT_LONG:
+            instruction.a.constant = &constants[readLong(offset + 1)];
+            length = 4;
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_FLAT_UPVALUE:
+        case OP_CALL:
+            instruction.a.index = bytes[offset + 1];
+            length = 2;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            instruction.a.name =
+                constants[bytes[offset + 1]].asType<ObjString *>();
+            length = 2;
+            break;
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            instruction.a.name =
+                constants[readLong(offset + 1)].asType<ObjString *>();
+            length = 4;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            length = 3;
+            jumps.emplace_back(code.size(),
+                               offset + length + readShort(offset + 1));
+            break;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            length = 4;
+            jumps.emplace_back(code.size(),
+                               offset + length + readLong(offset + 1));
+            break;
+        case OP_LOOP:
+            length = 3;
+            jumps.emplace_back(code.size(),
+                               offset + length - readShort(offset + 1));
+            break;
+        case OP_LOOP_LONG:
+            length = 4;
+            jumps.emplace_back(code.size(),
+                               offset + length - readLong(offset + 1));
+            break;
+        case OP_JUMP_IF_NOT_LESS_LOCALS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+        case OP_JUMP_IF_NOT_GREATER_LOCALS:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+        case OP_JUMP_IF_NOT_EQUAL_LOCALS:
+        case OP_JUMP_IF_EQUAL_LOCALS:
+            instruction.a.index = bytes[offset + 1];
+            instruction.b.index = bytes[offset + 2];
+            length = 5;
+            jumps.emplace_back(code.size(),
+                               offset + length + readShort(offset + 3));
+            break;
+        case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_GREATER_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_EQUAL_LOCAL_CONST:
+            instruction.a.index = bytes[offset + 1];
+            instruction.b.constant = &constants[bytes[offset + 2]];
+            length = 5;
+            jumps.emplace_back(code.size(),
+                               offset + length + readShort(offset + 3));
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            int constant = op == OP_CLOSURE ? bytes[offset + 1]
+                                            : readLong(offset + 1);
+            length = op == OP_CLOSURE ? 2 : 4;
+            auto *function = constants[constant].asType<ObjFunction *>();
+            instruction.a.constant = &constants[constant];
+            instruction.b.captures = bytes + offset + length;
+            length += 2 * function->getUpvalueCount();
+            break;
+        }
+        default:
+            break;
+        }
+
+        indexAt[offset] = static_cast<int>(code.size());
+        code.push_back(instruction);
+        offset += length;
+    }
+    indexAt[chunk.count] = static_cast<int>(code.size());
+
+    // `code` doesn't grow anymore, so pointers into it stay valid
+    code.shrink_to_fit();
+    for (auto [index, targetOffset] : jumps) {
+        code[index].target = code.data() + indexAt[targetOffset];
+    }
+
+    return decoded;
+}
+
+} // namespace Clox
@@ -0,0 +1,49 @@
+#ifndef CLOXPP_DECODED_CHUNK_H
+#define CLOXPP_DECODED_CHUNK_H
+
+#include <memory>
+#include <vector>
+
+#include "chunk.hpp"
+
+namespace Clox {
+
+class ObjString;
+
+// One fixed-width instruction, with its operands already decoded into what
+// its handler uses
+struct Instruction {
+    const void *handler; // address of the handler in VM::runDecoded
+
+    union Operand {
+        int index; // local or upvalue slot, or argument count
+        const Value *constant;
+        ObjString *name;
+        const uint8_t *captures; // the (kind, index) pairs of OP_CLOSURE
+    } a, b;
+
+    const Instruction *target; // where a jump goes
+    int offset;                // of the original instruction in its chunk
+};
+
+/*
+ * A chunk translated into Instructions, so that the interpreter doesn't
+ * decode operands on every execution. The bytecode in the Chunk remains
+ * the one that's serialized and disassembled.
+ */
+class DecodedChunk {
+public:
+    // `handlers` maps every opcode to its handler; the long form of an
+    // instruction shares the handler of the short one
+    static std::unique_ptr<DecodedChunk> decode(const Chunk &chunk,
+                                                const void *const *handlers);
+
+    const Instruction *begin() const { return code.data(); }
+
+private:
+    std::vector<Instruction> code;
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_DECODED_CHUNK_H
@@ -0,0 +1,449 @@
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+#include "compiler.hpp"
+#include "heap_snapshot.hpp"
+#include "memory.hpp"
+
+namespace Clox {
+
+static constexpr char MAGIC[4] = {'L', 'O', 'X', 'S'};
+
+enum ValueTag : uint8_t {
+    TAG_NIL,
+    TAG_NUMBER,
+    TAG_INTEGER,
+    TAG_BOOL,
+    TAG_STRING,
+    TAG_FUNCTION,
+    TAG_NATIVE,
+    TAG_CLOSURE,
+    TAG_UPVALUE,
+};
+
+// Every object to be saved, numbered per kind in the order they're found,
+// so that references (and cycles) can be written as indices
+struct HeapSnapshot::ObjectIndex {
+    std::vector<ObjString *> strings;
+    std::vector<ObjFunction *> functions;
+    std::vector<ObjNative *> natives;
+    std::vector<ObjClosure *> closures;
+    std::vector<ObjUpvalue *> upvalues;
+    std::unordered_map<const Obj *, int32_t> ids;
+
+    template <typename T>
+    bool insert(std::vector<T *> &objects, T *object) {
+        auto [it, isNew] =
+            ids.emplace(object, static_cast<int32_t>(objects.size()));
+        if (isNew)
+            objects.push_back(object);
+        return isNew;
+    }
+
+    int32_t idOf(const Obj *object) const { return ids.at(object); }
+
+    // walk everything reachable from `root` without recursing, since
+    // closures can form long chains; fails if some function can't be
+    // compiled
+    bool addReachable(Value root) {
+        std::vector<Value> pending{root};
+        while (!pending.empty()) {
+            Value value = pending.back();
+            pending.pop_back();
+
+            if (value.isType<ObjString *>()) {
+                insert(strings, value.asType<ObjString *>());
+            } else if (value.isType<ObjNative *>()) {
+                insert(natives, value.asType<ObjNative *>());
+            } else if (value.isType<ObjFunction *>()) {
+                auto *function = value.asType<ObjFunction *>();
+                if (!insert(functions, function))
+                    continue;
+                // a snapshot holds bytecode, not the source for lazy bodies
+                if (!function->isCompiled() &&
+                    !SinglePassCompiler::compileLazy(function))
+                    return false;
+                if (function->name)
+                    pending.push_back(function->name);
+                const ValueArray &constants = function->getChunk()->constants;
+                pending.insert(pending.end(), constants.values,
+                               constants.values + constants.count);
+            } else if (value.isType<ObjClosure *>()) {
+                auto *closure = value.asType<ObjClosure *>();
+                if (!insert(closures, closure))
+                    continue;
+                pending.push_back(closure->function);
+                pending.insert(pending.end(), closure->upvalues,
+                               closure->upvalues + closure->upvalueCount);
+            } else if (value.isType<ObjUpvalue *>()) {
+                auto *upvalue = value.asType<ObjUpvalue *>();
+                if (insert(upvalues, upvalue))
+                    pending.push_back(*upvalue->location);
+            }
+        }
+        return true;
+    }
+};
+
+// The objects recreated from a snapshot, indexed as in ObjectIndex
+struct HeapSnapshot::ObjectTable {
+    std::vector<ObjString *> strings;
+    std::vector<ObjFunction *> functions;
+    std::vector<ObjNative *> natives;
+    std::vector<ObjClosure *> closures;
+    std::vector<ObjUpvalue *> upvalues;
+};
+
+template <typename T>
+static bool lookup(const std::vector<T *> &objects, int32_t id, T *&object) {
+    if (id < 0 || static_cast<std::size_t>(id) >= objects.size())
+        return false;
+    object = objects[id];
+    return true;
+}
+
+bool HeapSnapshot::save(VM &vm, const std::string &path) {
+    // lazy bodies are compiled into the VM's heap before they are saved
+    Heap::Scope scope(vm.heap);
+    ObjectIndex index;
+    vm.heap.getStrings().forEach([&](ObjString *key, const Value &) {
+        index.insert(index.strings, key);
+    });
+    bool reachable = true;
+    vm.globals.forEach([&](ObjString *key, const Value &value) {
+        reachable = reachable && index.addReachable(key) &&
+                    index.addReachable(value);
+    });
+    if (!reachable)
+        return false;
+
+    // natives are code, so they are saved by the name the VM defines them
+    // under, and looked up again when booting
+    std::unordered_map<const ObjNative *, ObjString *> nativeNames;
+    vm.builtins.forEach([&](ObjString *key, const Value &value) {
+        nativeNames.emplace(value.asType<ObjNative *>(), key);
+    });
+    for (auto *native : index.natives) {
+        if (nativeNames.count(native) == 0)
+            return false;
+        index.insert(index.strings, nativeNames.at(native));
+    }
+
+    std::string image(MAGIC, sizeof(MAGIC));
+    put<uint32_t>(image, VERSION);
+
+    // first every object's identity, so the contents below can refer to
+    // objects in any order
+    put<int32_t>(image, static_cast<int32_t>(index.strings.size()));
+    for (auto *str : index.strings) {
+        putString(image, std::string_view(str->data(), str->size()));
+    }
+    put<int32_t>(image, static_cast<int32_t>(index.natives.size()));
+    for (auto *native : index.natives) {
+        put<int32_t>(image, index.idOf(nativeNames.at(native)));
+    }
+    put<int32_t>(image, static_cast<int32_t>(index.functions.size()));
+    for (auto *function : index.functions) {
+        put<int32_t>(image, function->arity);
+        put<int32_t>(image, function->upvalueCount);
+    }
+    put<int32_t>(image, static_cast<int32_t>(index.closures.size()));
+    for (auto *closure : index.closures) {
+        put<int32_t>(image, index.idOf(closure->function));
+    }
+    put<int32_t>(image, static_cast<int32_t>(index.upvalues.size()));
+
+    // then their contents
+    for (auto *function : index.functions) {
+        put<int32_t>(image, function->name ? index.idOf(function->name) : -1);
+
+        const Chunk *chunk = function->getChunk();
+        put<int32_t>(image, chunk->count);
+        image.append(reinterpret_cast<const char *>(chunk->code),
+                     chunk->count);
+        put<int32_t>(image, chunk->lineCount);
+        image.append(reinterpret_cast<const char *>(chunk->lines),
+                     sizeof(LineStart) * chunk->lineCount);
+        put<int32_t>(image, chunk->constants.count);
+        for (int i = 0; i < chunk->constants.count; i++) {
+            if (!writeValue(image, index, chunk->constants.values[i]))
+                return false;
+        }
+    }
+    for (auto *closure : index.closures) {
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            if (!writeValue(image, index, closure->upvalues[i]))
+                return false;
+        }
+    }
+    for (auto *upvalue : index.upvalues) {
+        if (!writeValue(image, index, *upvalue->location))
+            return false;
+    }
+
+    int32_t globalCount = 0;
+    vm.globals.forEach([&](ObjString *, const Value &) { globalCount++; });
+    put<int32_t>(image, globalCount);
+    bool ok = true;
+    vm.globals.forEach([&](ObjString *key, const Value &value) {
+        put<int32_t>(image, index.idOf(key));
+        ok = ok && writeValue(image, index, value);
+    });
+    if (!ok)
+        return false;
+
+    // a crash or a concurrent save never leaves a truncated snapshot
+    return writeFileAtomically(path, image);
+}
+
+bool HeapSnapshot::load(VM &vm, const std::string &path) {
+    Heap::Scope scope(vm.heap);
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs)
+        return false;
+    std::string image(std::istreambuf_iterator<char>{ifs}, {});
+
+    BinaryReader in(image.data(), image.data() + image.size());
+    const char *magic;
+    uint32_t version;
+    if (!in.getBytes(sizeof(MAGIC), magic) ||
+        std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !in.get(version) ||
+        version != VERSION) {
+        return false;
+    }
+
+    ObjectTable table;
+    int32_t count;
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        std::string_view str;
+        if (!in.getString(str))
+            return false;
+        table.strings.push_back(ObjString::copy(str));
+    }
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        int32_t nameId;
+        ObjString *name;
+        if (!in.get(nameId) || !lookup(table.strings, nameId, name))
+            return false;
+        auto native = vm.builtins.get(name);
+        if (!native.has_value())
+            return false;
+        table.natives.push_back(native->asType<ObjNative *>());
+    }
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        auto *function = Allocator::create<ObjFunction>();
+        if (!in.get(function->arity) || !in.get(function->upvalueCount) ||
+            function->upvalueCount < 0)
+            return false;
+        table.functions.push_back(function);
+    }
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        int32_t functionId;
+        ObjFunction *function;
+        if (!in.get(functionId) ||
+            !lookup(table.functions, functionId, function))
+            return false;
+        table.closures.push_back(Allocator::create<ObjClosure>(function));
+    }
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        auto *upvalue = Allocator::create<ObjUpvalue>(nullptr);
+        upvalue->location = &upvalue->closed;
+        table.upvalues.push_back(upvalue);
+    }
+
+    for (auto *function : table.functions) {
+        if (!readChunk(in, table, function))
+            return false;
+    }
+    for (auto *closure : table.closures) {
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            if (!readValue(in, table, closure->upvalues[i]))
+                return false;
+        }
+    }
+    for (auto *upvalue : table.upvalues) {
+        if (!readValue(in, table, upvalue->closed))
+            return false;
+    }
+
+    if (!in.get(count) || count < 0)
+        return false;
+    for (int32_t i = 0; i < count; i++) {
+        int32_t nameId;
+        ObjString *name;
+        Value value;
+        if (!in.get(nameId) || !lookup(table.strings, nameId, name) ||
+            !readValue(in, table, value))
+            return false;
+        vm.globals.set(name, value);
+    }
+
+    return in.atEnd();
+}
+
+bool HeapSnapshot::writeValue(std::string &out, const ObjectIndex &index,
+                              const Value &value) {
+    if (value.isType<Nil>()) {
+        put<uint8_t>(out, TAG_NIL);
+    } else if (value.isType<Number>()) {
+        put<uint8_t>(out, TAG_NUMBER);
+        put<Number>(out, value.asType<Number>());
+    } else if (value.isType<Integer>()) {
+        put<uint8_t>(out, TAG_INTEGER);
+        put<Integer>(out, value.asType<Integer>());
+    } else if (value.isType<bool>()) {
+        put<uint8_t>(out, TAG_BOOL);
+        put<uint8_t>(out, value.asType<bool>());
+    } else if (value.isType<ObjString *>()) {
+        put<uint8_t>(out, TAG_STRING);
+        put<int32_t>(out, index.idOf(value.asType<ObjString *>()));
+    } else if (value.isType<ObjFunction *>()) {
+        put<uint8_t>(out, TAG_FUNCTION);
+        put<int32_t>(out, index.idOf(value.asType<ObjFunction *>()));
+    } else if (value.isType<ObjNative *>()) {
+        put<uint8_t>(out, TAG_NATIVE);
+        put<int32_t>(out, index.idOf(value.asType<ObjNative *>()));
+    } else if (value.isType<ObjClosure *>()) {
+        put<uint8_t>(out, TAG_CLOSURE);
+        put<int32_t>(out, index.idOf(value.asType<ObjClosure *>()));
+    } else if (value.isType<ObjUpvalue *>()) {
+        put<uint8_t>(out, TAG_UPVALUE);
+        put<int32_t>(out, index.idOf(value.asType<ObjUpvalue *>()));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool HeapSnapshot::readValue(BinaryReader &in, const ObjectTable &table,
+                             Value &value) {
+    uint8_t tag;
+    if (!in.get(tag))
+        return false;
+
+    switch (tag) {
+    case TAG_NIL:
+        value = Nil{};
+        return true;
+    case TAG_NUMBER: {
+        Number number;
+        if (!in.get(number))
+            return false;
+        value = number;
+        return true;
+    }
+    case TAG_INTEGER: {
+        Integer integer;
+        if (!in.get(integer))
+            return false;
+        value = integer;
+        return true;
+    }
+    case TAG_BOOL: {
+        uint8_t boolean;
+        if (!in.get(boolean))
+            return false;
+        value = boolean != 0;
+        return true;
+    }
+    }
+
+    int32_t id;
+    if (!in.get(id))
+        return false;
+
+    switch (tag) {
+    case TAG_STRING: {
+        ObjString *str;
+        if (!lookup(table.strings, id, str))
+            return false;
+        value = str;
+        return true;
+    }
+    case TAG_FUNCTION: {
+        ObjFunction *function;
+        if (!lookup(table.functions, id, function))
+            return false;
+        value = function;
+        return true;
+    }
+    case TAG_NATIVE: {
+        ObjNative *native;
+        if (!lookup(table.natives, id, native))
+            return false;
+        value = native;
+        return true;
+    }
+    case TAG_CLOSURE: {
+        ObjClosure *closure;
+        if (!lookup(table.closures, id, closure))
+            return false;
+        value = closure;
+        return true;
+    }
+    case TAG_UPVALUE: {
+        ObjUpvalue *upvalue;
+        if (!lookup(table.upvalues, id, upvalue))
+            return false;
+        value = upvalue;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool HeapSnapshot::readChunk(BinaryReader &in, const ObjectTable &table,
+                             ObjFunction *function) {
+    int32_t nameId, codeCount, lineCount, constantCount;
+    const char *code, *lines;
+    if (!in.get(nameId) ||
+        (nameId != -1 && !lookup(table.strings, nameId, function->name)) ||
+        !in.get(codeCount) || !in.getBytes(codeCount, code) ||
+        !in.get(lineCount)) {
+        return false;
+    }
+
+    constexpr auto lineSize = static_cast<int32_t>(sizeof(LineStart));
+    if (lineCount < 0 || lineCount > INT32_MAX / lineSize ||
+        !in.getBytes(lineCount * lineSize, lines)) {
+        return false;
+    }
+
+    Chunk *chunk = function->getChunk();
+    chunk->code = Allocator::allocate<uint8_t>(codeCount);
+    chunk->count = chunk->capacity = codeCount;
+    std::memcpy(chunk->code, code, codeCount);
+    chunk->lines = Allocator::allocate<LineStart>(lineCount);
+    chunk->lineCount = chunk->lineCapacity = lineCount;
+    std::memcpy(chunk->lines, lines, lineCount * lineSize);
+
+    if (!in.get(constantCount) || constantCount < 0)
+        return false;
+    for (int32_t i = 0; i < constantCount; i++) {
+        Value value;
+        if (!readValue(in, table, value))
+            return false;
+        chunk->addConstant(value);
+    }
+    return true;
+}
+
+} // namespace Clox
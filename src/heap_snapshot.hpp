@@ -0,0 +1,40 @@
+#ifndef CLOXPP_HEAP_SNAPSHOT_H
+#define CLOXPP_HEAP_SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+
+#include "binary_io.hpp"
+#include "vm.hpp"
+
+namespace Clox {
+
+/*
+ * The heap of a VM that has finished running a script: its globals,
+ * everything reachable from them, and the interned strings. Booting a
+ * fresh VM from a snapshot restores all of that without running the
+ * script again, so expensive initialization can be done once and saved.
+ */
+class HeapSnapshot {
+public:
+    // bump whenever the file layout changes
+    static constexpr uint32_t VERSION = 3;
+
+    static bool save(VM &vm, const std::string &path);
+    static bool load(VM &vm, const std::string &path);
+
+private:
+    struct ObjectIndex;
+    struct ObjectTable;
+
+    static bool writeValue(std::string &out, const ObjectIndex &index,
+                           const Value &value);
+    static bool readValue(BinaryReader &in, const ObjectTable &table,
+                          Value &value);
+    static bool readChunk(BinaryReader &in, const ObjectTable &table,
+                          ObjFunction *function);
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_HEAP_SNAPSHOT_H
@@ -1,4 +1,3 @@
-#include <iostream>
 #include <memory>
 #include <variant>
 
@@ -65,8 +64,10 @@ void Interpreter::interpret(const std::vector<Stmt::StmtPtr> &statements) {
             execute(stmt);
         }
     } catch (const RuntimeError &error) {
+        output.flush();
         handler.runtimeError(error);
     }
+    output.flush();
 }
 
 void Interpreter::execute(const Stmt::StmtPtr stmt) {
@@ -80,7 +81,7 @@ void Interpreter::visit(Stmt::ExprPtr stmt) {
 
 void Interpreter::visit(Stmt::PrintPtr stmt) {
     Value value = evaluate(stmt->expr);
-    std::cout << value << "\n";
+    output << value << '\n';
 }
 
 void Interpreter::visit(Stmt::VarPtr stmt) {
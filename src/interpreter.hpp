@@ -7,6 +7,7 @@
 #include "environment.hpp"
 #include "error_handler.hpp"
 #include "expr.hpp"
+#include "output_buffer.hpp"
 #include "stmt.hpp"
 #include "value.hpp"
 
@@ -41,6 +42,7 @@ private:
     EnvironmentPtr globals_;
     EnvironmentPtr currentEnvironment;
     std::unordered_map<Expr::ExprPtr, int> locals;
+    OutputBuffer output; // what print statements write to
 
     Value evaluate(const Expr::ExprPtr expr);
     Value visit(Expr::BinaryPtr expr) override;
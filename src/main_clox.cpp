@@ -1,16 +1,168 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "batch_runner.hpp"
 #include "stack_vm.hpp"
 
 int main(int argc, const char *argv[]) {
     using namespace Clox;
 
-    StackVM vm{};
-    if (argc > 2) {
-        std::cerr << "Usage: " << argv[0] << " [path]";
+    // --cache keeps compiled scripts next to them, --cache=DIR inside DIR;
+    // --boot=FILE starts from a heap snapshot that --snapshot=FILE saves
+    // after running the script; --lazy compiles functions on first call;
+    // --time-load reports the time from opening the script to running it;
+    // --predecode runs pre-decoded instructions instead of the bytecode,
+    // --stack-cache keeps the top of the stack in a register, --registers
+    // runs register instructions translated from the bytecode, and only
+    // one of those three loops can be picked;
+    // --flush=line writes printed output out line by line, --flush=size
+    // in large blocks, instead of by line only on a terminal;
+    // --batch runs every path given, --batch=FILE every path listed in
+    // FILE, each in a VM of its own on --jobs=N threads, and prints what
+    // each script wrote and how it exited as a line of JSON
+    std::vector<BatchRunner::Setup> settings;
+    const char *snapshotPath = nullptr;
+    bool batch = false;
+    const char *manifestPath = nullptr;
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    std::string_view loop; // the interpreter loop option given, if any
+    bool loopConflict = false;
+    bool usageError = false;
+    // options can come before or after the paths
+    std::vector<std::string> paths;
+    for (int argi = 1; argi < argc; argi++) {
+        if (std::strncmp(argv[argi], "--", 2) != 0) {
+            paths.emplace_back(argv[argi]);
+            continue;
+        }
+        std::string_view option = argv[argi];
+        const char *value = std::strchr(argv[argi], '=');
+        value = value ? value + 1 : "";
+        if (option == "--cache") {
+            settings.push_back(
+                [](StackVM &vm) { vm.enableBytecodeCache(""); });
+        } else if (option.substr(0, 8) == "--cache=") {
+            std::string dir = value;
+            settings.push_back(
+                [dir](StackVM &vm) { vm.enableBytecodeCache(dir); });
+        } else if (option == "--lazy") {
+            settings.push_back(&StackVM::enableLazyCompilation);
+        } else if (option == "--time-load") {
+            settings.push_back(&StackVM::enableLoadTiming);
+        } else if (option == "--predecode") {
+            settings.push_back(&StackVM::enablePredecoding);
+            loopConflict |= !loop.empty() && loop != option;
+            loop = option;
+        } else if (option == "--stack-cache") {
+            settings.push_back(&StackVM::enableStackCaching);
+            loopConflict |= !loop.empty() && loop != option;
+            loop = option;
+        } else if (option == "--registers") {
+            settings.push_back(&StackVM::enableRegisters);
+            loopConflict |= !loop.empty() && loop != option;
+            loop = option;
+        } else if (option == "--flush=line") {
+            settings.push_back([](StackVM &vm) {
+                vm.setFlushPolicy(OutputBuffer::FlushPolicy::LINE);
+            });
+        } else if (option == "--flush=size") {
+            settings.push_back([](StackVM &vm) {
+                vm.setFlushPolicy(OutputBuffer::FlushPolicy::SIZE);
+            });
+        } else if (option.substr(0, 7) == "--boot=") {
+            std::string path = value;
+            settings.push_back(
+                [path](StackVM &vm) { vm.bootFromSnapshot(path); });
+        } else if (option.substr(0, 11) == "--snapshot=") {
+            snapshotPath = value;
+        } else if (option == "--batch") {
+            batch = true;
+        } else if (option.substr(0, 8) == "--batch=") {
+            batch = true;
+            manifestPath = value;
+        } else if (option.substr(0, 7) == "--jobs=") {
+            char *end;
+            unsigned long count = std::strtoul(value, &end, 10);
+            usageError |= *end != '\0' || count == 0 || count > 1024;
+            jobs = static_cast<unsigned>(count);
+        } else {
+            std::cerr << "Unknown option " << argv[argi];
+            std::exit(64);
+        }
+    }
+
+    if (loopConflict) {
+        std::cerr << "Pick only one of --predecode, --stack-cache and"
+                     " --registers";
+        std::exit(64);
+    }
+
+    if (batch) {
+        usageError |= snapshotPath ||
+                      (manifestPath ? !paths.empty() : paths.empty());
+    } else {
+        usageError |= paths.size() > 1 || (snapshotPath && paths.size() != 1);
+    }
+    if (usageError) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--cache[=dir]] [--lazy] [--time-load] [--predecode]"
+                     " [--stack-cache] [--registers] [--flush=line|size]"
+                     " [--boot=file] [--snapshot=file] [path]\n"
+                     "       "
+                  << argv[0]
+                  << " [options] [--jobs=n] (--batch path... |"
+                     " --batch=manifest)";
         std::exit(64);
-    } else if (argc == 2) {
-        vm.runFile(argv[1]);
+    }
+
+    if (batch) {
+        std::vector<std::string> scripts = std::move(paths);
+        if (manifestPath) {
+            try {
+                scripts = BatchRunner::readManifest(manifestPath);
+            } catch (const std::ios_base::failure &) {
+                std::cerr << "Could not open manifest " << manifestPath
+                          << std::endl;
+                std::exit(74);
+            }
+        }
+
+        BatchRunner runner(
+            [&settings](StackVM &vm) {
+                for (const auto &apply : settings)
+                    apply(vm);
+            },
+            jobs);
+        auto start = std::chrono::steady_clock::now();
+        auto results = runner.run(scripts);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        BatchRunner::writeResults(std::cout, results);
+        BatchRunner::writeSummary(std::cerr, results, elapsed.count(), jobs);
+        // the worst status of any script, so that 0 means they all passed
+        int status = 0;
+        for (const auto &result : results)
+            status = std::max(status, result.status);
+        return status;
+    }
+
+    StackVM vm{};
+    for (const auto &apply : settings)
+        apply(vm);
+    if (paths.size() == 1) {
+        vm.runFile(paths[0].c_str());
+        if (snapshotPath && !vm.saveSnapshot(snapshotPath))
+            std::exit(74);
     } else {
         vm.runPrompt();
     }
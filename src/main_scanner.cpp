@@ -1,12 +1,17 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <thread>
 
 #include "error_handler.hpp"
 #include "scanner.hpp"
 #include "token.hpp"
 #include "utils.hpp"
 
-void scan(const std::string &source) {
+void scan(std::string_view source) {
     auto errorHandler = ErrorHandler();
     auto scanner = Scanner(source);
 
@@ -23,7 +28,106 @@ void scan(const std::string &source) {
     }
 }
 
-void scanFile(const char *path) { scan(readFile(path)); }
+void scanFile(const char *path) { scan(SourceFile(path).text()); }
+
+static void reportThroughput(const char *mode, std::size_t tokenCount,
+                             std::size_t size,
+                             std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << mode << ": " << tokenCount << " tokens in " << size / 1e6
+              << " MB, " << elapsed.count() << " s, "
+              << tokenCount / 1e6 / elapsed.count() << " M tokens/s, "
+              << size / 1e6 / elapsed.count() << " MB/s\n";
+}
+
+// Scans the script at `path`, repeated to make up a large input, one
+// token at a time and then in batches, and reports how fast that went.
+void measureThroughput(const char *path) {
+    static constexpr std::size_t INPUT_SIZE = 64 * 1024 * 1024;
+    static constexpr std::size_t BATCH_SIZE = 256;
+
+    SourceFile file(path);
+    std::string source;
+    source.reserve(INPUT_SIZE + file.text().size() + 1);
+    while (!file.text().empty() && source.size() < INPUT_SIZE) {
+        source += file.text();
+        source += '\n';
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto scanner = Scanner(source);
+    std::size_t tokenCount = 0;
+    for (;;) {
+        Token token = scanner.scanOneToken();
+        if (token.type == TokenType::ERROR || token.type == TokenType::EOF_)
+            break;
+        tokenCount++;
+    }
+    reportThroughput("one at a time", tokenCount, source.size(), start);
+
+    start = std::chrono::steady_clock::now();
+    scanner = Scanner(source);
+    tokenCount = 0;
+    CompactToken batch[BATCH_SIZE];
+    for (bool done = false; !done;) {
+        std::size_t count = scanner.scanBatch(batch, BATCH_SIZE);
+        for (std::size_t i = 0; i < count && !done; i++) {
+            done = batch[i].type == TokenType::ERROR ||
+                   batch[i].type == TokenType::EOF_;
+            tokenCount += !done;
+        }
+    }
+    reportThroughput("in batches", tokenCount, source.size(), start);
+
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    start = std::chrono::steady_clock::now();
+    TokenStream tokens = TokenStream::scanInParallel(source, threads);
+    tokenCount = 0;
+    for (;;) {
+        Token token = tokens.next();
+        if (token.type == TokenType::ERROR || token.type == TokenType::EOF_)
+            break;
+        tokenCount++;
+    }
+    std::string mode = "on " + std::to_string(threads) + " threads";
+    reportThroughput(mode.c_str(), tokenCount, source.size(), start);
+}
+
+// Scans the script at `path` on every number of threads up to one more
+// than its line count, so that it is split at each line that can start a
+// part, and reports the first token that differs from a scan on one
+// thread. Returns whether they all matched.
+bool checkParallelScan(const char *path) {
+    SourceFile file(path);
+    std::string_view source = file.text();
+    auto lines = std::count(source.begin(), source.end(), '\n');
+    unsigned maxThreads = static_cast<unsigned>(std::min<long>(lines, 255)) + 1;
+
+    for (unsigned threads = 1; threads <= maxThreads; threads++) {
+        TokenStream expected(source);
+        TokenStream actual = TokenStream::scanInParallel(source, threads);
+        for (std::size_t i = 0;; i++) {
+            Token want = expected.next();
+            Token got = actual.next();
+            // error messages aren't in the source, so compare their text
+            bool same = want.type == got.type && want.line == got.line &&
+                        want.lexeme == got.lexeme &&
+                        (want.type == TokenType::ERROR ||
+                         want.lexeme.data() == got.lexeme.data());
+            if (!same) {
+                std::cout << path << ": token " << i << " on " << threads
+                          << " threads is " << got << "on line " << got.line
+                          << ", expected " << want << "on line "
+                          << want.line << "\n";
+                return false;
+            }
+            if (want.type == TokenType::EOF_)
+                break;
+        }
+    }
+    return true;
+}
 
 void scanREPL() {
     std::string line;
@@ -35,8 +139,13 @@ void scanREPL() {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc > 2) {
-        std::cerr << "Usage: " << argv[0] << " [script]";
+    if (argc == 3 && std::strcmp(argv[1], "--throughput") == 0) {
+        measureThroughput(argv[2]);
+    } else if (argc == 3 && std::strcmp(argv[1], "--check-parallel") == 0) {
+        return checkParallelScan(argv[2]) ? 0 : 1;
+    } else if (argc > 2) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--throughput|--check-parallel] [script]";
         std::exit(64);
     } else if (argc == 2) {
         scanFile(argv[1]);
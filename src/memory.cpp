@@ -4,8 +4,17 @@
 
 namespace Clox {
 
-std::vector<Obj *> Allocator::objects = {};
-Table Allocator::strings = {};
+thread_local Heap *Heap::entered = nullptr;
+
+Heap::~Heap() {
+    for (auto *obj : objects) {
+        delete obj;
+    }
+}
+
+Heap::Scope::Scope(Heap &heap) : previous(entered) { entered = &heap; }
+
+Heap::Scope::~Scope() { entered = previous; }
 
 void *Allocator::reallocate(void *pointer, size_t /*oldSize*/, size_t newSize) {
     if (newSize == 0) {
@@ -20,11 +29,4 @@ void *Allocator::reallocate(void *pointer, size_t /*oldSize*/, size_t newSize) {
     return result;
 }
 
-void Allocator::cleanUp() {
-    for (auto *obj : objects) {
-        delete obj;
-    }
-    objects.clear();
-}
-
 } // namespace Clox
@@ -1,6 +1,7 @@
 #ifndef CLOXPP_MEMORY_H
 #define CLOXPP_MEMORY_H
 
+#include <cassert>
 #include <cstddef>
 #include <type_traits>
 #include <vector>
@@ -10,6 +11,42 @@
 
 namespace Clox {
 
+/*
+ * Everything one VM allocates: its objects and the table interning its
+ * strings. Allocator creates objects in the heap entered on the calling
+ * thread, so VMs that each run on their own thread share nothing.
+ */
+class Heap {
+public:
+    Heap() = default;
+    ~Heap(); // frees every object
+    Heap(const Heap &) = delete;
+    Heap &operator=(const Heap &) = delete;
+
+    // makes `heap` the one Allocator works on in this thread until the
+    // scope ends; scopes nest
+    class Scope {
+    public:
+        explicit Scope(Heap &heap);
+        ~Scope();
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        Heap *previous;
+    };
+
+    const Table &getStrings() const { return strings; }
+
+private:
+    std::vector<Obj *> objects;
+    Table strings; // string interning
+
+    static thread_local Heap *entered;
+
+    friend class Allocator;
+};
+
 class Allocator {
 public:
     static constexpr size_t growCapacity(size_t capacity) {
@@ -36,25 +73,26 @@ public:
     static T *create(Args... args) {
         static_assert(std::is_base_of<Obj, T>::value, "T must be an Obj type");
         T *newT = new T(std::forward<Args>(args)...);
-        objects.push_back(newT);
+        Heap &heap = current();
+        heap.objects.push_back(newT);
 
         if constexpr (std::is_same<T, ObjString>::value) {
             // intern the created string
-            strings.set(static_cast<ObjString *>(newT), Nil{});
+            heap.strings.set(static_cast<ObjString *>(newT), Nil{});
         }
 
         return newT;
     }
 
-    static const Table &getStringSet() { return strings; }
+    static const Table &getStringSet() { return current().strings; }
 
     static void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
-    static void cleanUp();
-
 private:
-    static std::vector<Obj *> objects;
-    static Table strings; // string interning
+    static Heap &current() {
+        assert(Heap::entered && "no heap entered on this thread");
+        return *Heap::entered;
+    }
 
     Allocator(){};
     ~Allocator(){};
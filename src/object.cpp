@@ -13,18 +13,18 @@ static uint32_t hashString(const char *key, int length) {
     return hash;
 }
 
-ObjString::ObjString(char *chars, int length, uint32_t hash)
-    : chars(chars), length(length), hash(hash) {}
+ObjString::ObjString(char *chars, int length, uint32_t hash, bool ownsChars)
+    : chars(chars), length(length), hash(hash), ownsChars(ownsChars) {}
 
 ObjString::ObjString(std::string_view str, uint32_t hash)
     : chars(Allocator::allocate<char>(str.length() + 1)), length(str.length()),
-      hash(hash) {
+      hash(hash), ownsChars(true) {
     std::copy(str.begin(), str.end(), chars);
     chars[length] = '\0';
 }
 
 ObjString::~ObjString() {
-    if (chars) {
+    if (chars && ownsChars) {
         Allocator::freeArray<char>(chars, length);
         length = 0;
     }
@@ -58,6 +58,19 @@ ObjString *ObjString::take(char *chars, int length) {
     return Allocator::create<ObjString>(chars, length, hash);
 }
 
+ObjString *ObjString::borrow(std::string_view str) {
+    uint32_t hash = hashString(str.data(), str.size());
+    ObjString *interned =
+        Allocator::getStringSet().findString(str.data(), str.size(), hash);
+    if (interned)
+        return interned;
+
+    // the characters are never written through a borrowed string
+    return Allocator::create<ObjString>(const_cast<char *>(str.data()),
+                                        static_cast<int>(str.size()), hash,
+                                        false);
+}
+
 ObjString *ObjString::concatenate(const ObjString &str1,
                                   const ObjString &str2) {
     int length = str1.size() + str2.size();
@@ -72,7 +85,8 @@ ObjString *ObjString::concatenate(const ObjString &str1,
 }
 
 ObjFunction::ObjFunction()
-    : arity(0), upvalueCount(0), chunk({}), name(nullptr) {}
+    : arity(0), upvalueCount(0), chunk({}), name(nullptr),
+      lazyBody(nullptr) {}
 
 ObjFunction::~ObjFunction() {
     // ObjFunction doesn't own anything, not even its name,
@@ -89,6 +103,8 @@ const char *ObjFunction::getName() const {
 
 int ObjFunction::getUpvalueCount() const { return upvalueCount; }
 
+bool ObjFunction::isCompiled() const { return !lazyBody; }
+
 ObjNative::ObjNative(NativeFn function) : function(function) {}
 
 ObjNative::~ObjNative() {} // do nothing
@@ -98,17 +114,17 @@ const char *ObjNative::getName() const { return "<native fn>"; }
 ObjClosure::ObjClosure(ObjFunction *function)
     : function(function), upvalues(nullptr), upvalueCount(0) {
     upvalueCount = function->getUpvalueCount();
-    upvalues = Allocator::allocate<ObjUpvalue *>(upvalueCount);
+    upvalues = Allocator::allocate<Value>(upvalueCount);
 
     // NOTE: a bit redundant, might remove later
     for (int i = 0; i < upvalueCount; i++) {
-        upvalues[i] = nullptr;
+        upvalues[i] = Nil{};
     }
 }
 
 ObjClosure::~ObjClosure() {
     if (upvalues) {
-        Allocator::freeArray<ObjUpvalue *>(upvalues, upvalueCount);
+        Allocator::freeArray<Value>(upvalues, upvalueCount);
     }
 }
 
@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
 #include <string_view>
 
 #include "chunk.hpp"
@@ -18,6 +20,9 @@ class ObjString : public Obj {
 public:
     static ObjString *copy(std::string_view str);
     static ObjString *take(char *chars, int length);
+    // like `copy`, but keeps pointing at `str`, which must be
+    // NUL-terminated and outlive the string
+    static ObjString *borrow(std::string_view str);
     static ObjString *concatenate(const ObjString &str1, const ObjString &str2);
 
     const char *data() const;
@@ -28,10 +33,11 @@ private:
     char *chars;
     int length;
     uint32_t hash;
+    bool ownsChars;
 
     // constructors are private; ObjString should be created only by
-    // `ObjString::copy` and `ObjString::take`
-    ObjString(char *chars, int length, uint32_t hash);
+    // `ObjString::copy`, `ObjString::take` and `ObjString::borrow`
+    ObjString(char *chars, int length, uint32_t hash, bool ownsChars = true);
     ObjString(std::string_view str, uint32_t hash);
     ~ObjString() override;
 
@@ -43,6 +49,13 @@ enum class FunctionType {
     FUNCTION,
 };
 
+// where to find the body of a function whose compilation is deferred
+struct LazyBody {
+    std::shared_ptr<const std::string> source;
+    std::size_t offset; // of the '(' opening the parameter list
+    int line;
+};
+
 class ObjFunction : public Obj {
 public:
     ObjFunction();
@@ -52,14 +65,19 @@ public:
     int getArity() const;
     Chunk *getChunk();
     int getUpvalueCount() const;
+    bool isCompiled() const;
 
 private:
     int arity;
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+    std::unique_ptr<LazyBody> lazyBody; // null once compiled
 
     friend class Compiler;
+    friend class SinglePassCompiler;
+    friend class BytecodeCache;
+    friend class HeapSnapshot;
 };
 
 using NativeFn = std::function<Value(int, Value *)>;
@@ -80,7 +98,9 @@ public:
     ~ObjClosure() override;
 
     ObjFunction *function;
-    ObjUpvalue **upvalues;
+    // each slot holds either an ObjUpvalue * (variables captured by
+    // reference) or the captured value itself (flat captures)
+    Value *upvalues;
     int upvalueCount;
 };
 
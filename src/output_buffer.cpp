@@ -0,0 +1,100 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output_buffer.hpp"
+
+OutputBuffer::OutputBuffer(int fd)
+    : fd(fd), sink(nullptr),
+      policy(isatty(fd) ? FlushPolicy::LINE : FlushPolicy::SIZE),
+      data(new char[CAPACITY]), used(0) {}
+
+OutputBuffer::~OutputBuffer() { flush(); }
+
+void OutputBuffer::setFlushPolicy(FlushPolicy policy) {
+    this->policy = policy;
+    if (policy == FlushPolicy::LINE)
+        flush();
+}
+
+void OutputBuffer::captureInto(std::string &sink) {
+    flush();
+    this->sink = &sink;
+    // nobody is watching a string line by line
+    policy = FlushPolicy::SIZE;
+}
+
+OutputBuffer &OutputBuffer::operator<<(std::string_view text) {
+    if (text.size() <= CAPACITY - used) {
+        std::memcpy(data.get() + used, text.data(), text.size());
+        used += text.size();
+    } else if (text.size() < CAPACITY) {
+        flush();
+        std::memcpy(data.get(), text.data(), text.size());
+        used = text.size();
+    } else {
+        // too big to be worth copying
+        writeOut(text.data(), text.size());
+    }
+    return *this;
+}
+
+OutputBuffer &OutputBuffer::operator<<(char c) {
+    if (used == CAPACITY)
+        flush();
+    data[used++] = c;
+    if (c == '\n' && policy == FlushPolicy::LINE)
+        flush();
+    return *this;
+}
+
+char *OutputBuffer::reserve(std::size_t size) {
+    if (size > CAPACITY - used)
+        flush();
+    return data.get() + used;
+}
+
+void OutputBuffer::flush() {
+    if (used > 0)
+        writeOut(nullptr, 0);
+}
+
+void OutputBuffer::writeOut(const char *extra, std::size_t size) {
+    if (sink) {
+        sink->append(data.get(), used);
+        if (size > 0)
+            sink->append(extra, size);
+        used = 0;
+        return;
+    }
+
+    std::fflush(stdout);
+
+    iovec parts[2] = {{data.get(), used}, {const_cast<char *>(extra), size}};
+    iovec *part = parts;
+    int count = size > 0 ? 2 : 1;
+    while (count > 0) {
+        ssize_t written = writev(fd, part, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            break; // like std::cout, give up on a broken output
+        }
+
+        // skip whatever has been written, possibly part of an iovec
+        auto remaining = static_cast<std::size_t>(written);
+        while (count > 0 && remaining >= part->iov_len) {
+            remaining -= part->iov_len;
+            part++;
+            count--;
+        }
+        if (count > 0) {
+            part->iov_base = static_cast<char *>(part->iov_base) + remaining;
+            part->iov_len -= remaining;
+        }
+    }
+    used = 0;
+}
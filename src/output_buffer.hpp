@@ -0,0 +1,56 @@
+#ifndef CLOXPP_OUTPUT_BUFFER_H
+#define CLOXPP_OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/*
+ * Output that the interpreters' print statements format into directly,
+ * written to a file descriptor (stdout by default) in large writes.
+ * Whatever stdio has buffered for stdout is flushed before every write,
+ * so that output through either stays in order. Output can be captured
+ * in a string instead, which leaves stdio alone.
+ */
+class OutputBuffer {
+public:
+    enum class FlushPolicy {
+        LINE, // at the end of every line, for interactive use
+        SIZE, // only when the buffer is full
+    };
+
+    // flushes lines on a terminal and when full otherwise
+    explicit OutputBuffer(int fd = 1);
+    ~OutputBuffer();
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    void setFlushPolicy(FlushPolicy policy);
+    // append everything written from here on to `sink` instead
+    void captureInto(std::string &sink);
+
+    OutputBuffer &operator<<(std::string_view text);
+    // ending a line flushes it under FlushPolicy::LINE
+    OutputBuffer &operator<<(char c);
+
+    // room for `size` bytes to be written in place, then `commit`ted
+    char *reserve(std::size_t size);
+    void commit(std::size_t size) { used += size; }
+
+    void flush();
+
+private:
+    static constexpr std::size_t CAPACITY = 64 * 1024;
+
+    int fd;
+    std::string *sink; // or nullptr to write to `fd`
+    FlushPolicy policy;
+    std::unique_ptr<char[]> data;
+    std::size_t used;
+
+    // writes the buffer followed by `size` bytes at `extra`
+    void writeOut(const char *extra, std::size_t size);
+};
+
+#endif // !CLOXPP_OUTPUT_BUFFER_H
@@ -10,16 +10,21 @@
 
 using Jlox::FunctionType;
 
-Parser::Parser(const std::vector<Token> &tokens, ErrorHandler &handler)
+Parser::Parser(TokenStream &tokens, ErrorHandler &handler)
     : handler(handler), tokens(tokens) {}
 
 std::vector<Stmt::StmtPtr> Parser::parse() {
     auto statements = std::vector<Stmt::StmtPtr>();
-    while (!isAtEnd()) {
-        auto stmt = declaration();
-        if (stmt) {
-            statements.push_back(stmt);
+    try {
+        current = scan();
+        while (!isAtEnd()) {
+            auto stmt = declaration();
+            if (stmt) {
+                statements.push_back(stmt);
+            }
         }
+    } catch (const ScanError &) {
+        // already reported, and nothing after it is parsed
     }
 
     return statements;
@@ -490,14 +495,24 @@ bool Parser::check(TokenType type) {
 
 bool Parser::isAtEnd() { return peek().type == TokenType::EOF_; }
 
+Token Parser::scan() {
+    Token token = tokens.next();
+    if (token.type == TokenType::ERROR) {
+        handler.error(token.line, token.getLexemeString().data());
+        throw ScanError();
+    }
+    return token;
+}
+
 Token Parser::advance() {
     if (!isAtEnd()) {
-        current++;
+        previous_ = current;
+        current = scan();
     }
 
     return previous();
 }
 
-Token Parser::peek() { return tokens.at(current); }
+Token Parser::peek() { return current; }
 
-Token Parser::previous() { return tokens.at(current - 1); }
+Token Parser::previous() { return previous_; }
@@ -7,16 +7,20 @@
 
 #include "error_handler.hpp"
 #include "expr.hpp"
+#include "scanner.hpp"
 #include "stmt.hpp"
 #include "token.hpp"
 
 class Parser {
 private:
     ErrorHandler &handler;
-    std::vector<Token> tokens;
-    std::size_t current = 0;
+    TokenStream &tokens;
+    Token current;
+    Token previous_;
 
     class ParserError : std::exception {};
+    // ends the parse at the first error the scanner finds, which it reports
+    class ScanError : std::exception {};
 
     Expr::ExprPtr expression();
     Expr::ExprPtr assignment();
@@ -49,6 +53,7 @@ private:
     bool match(std::initializer_list<TokenType> types);
     bool check(TokenType type);
     bool isAtEnd();
+    Token scan();
     Token advance();
     Token peek();
     Token previous();
@@ -56,7 +61,7 @@ private:
     ParserError error(Token token, const char *message);
 
 public:
-    Parser(const std::vector<Token> &tokens, ErrorHandler &handler);
+    Parser(TokenStream &tokens, ErrorHandler &handler);
     std::vector<Stmt::StmtPtr> parse();
 };
 
@@ -0,0 +1,401 @@
+#include <utility>
+
+#include "object.hpp"
+#include "register_chunk.hpp"
+
+namespace Clox {
+
+namespace {
+
+int readShort(const uint8_t *bytes) { return (bytes[0] << 8) | bytes[1]; }
+
+int readLong(const uint8_t *bytes) {
+    return (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+}
+
+int instructionLength(const Chunk &chunk, int offset) {
+    const uint8_t *bytes = chunk.code + offset;
+    switch (bytes[0]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_FLAT_UPVALUE:
+    case OP_CALL:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+        return 4;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+        int constant = bytes[0] == OP_CLOSURE ? bytes[1] : readLong(bytes + 1);
+        auto *function =
+            chunk.constants.values[constant].asType<ObjFunction *>();
+        return (bytes[0] == OP_CLOSURE ? 2 : 4) +
+               2 * function->getUpvalueCount();
+    }
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+        return 1;
+    default: // the fused comparisons of two locals, or a local and constant
+        return 5;
+    }
+}
+
+// the offset the instruction at `offset` may jump to, or -1
+int jumpTarget(const Chunk &chunk, int offset) {
+    const uint8_t *bytes = chunk.code + offset;
+    int length = instructionLength(chunk, offset);
+    switch (bytes[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return offset + length + readShort(bytes + 1);
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+        return offset + length + readLong(bytes + 1);
+    case OP_LOOP:
+        return offset + length - readShort(bytes + 1);
+    case OP_LOOP_LONG:
+        return offset + length - readLong(bytes + 1);
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CALL:
+    case OP_RETURN:
+        return -1;
+    default:
+        return length == 5 ? offset + length + readShort(bytes + 3) : -1;
+    }
+}
+
+// the register form of a comparison fused into a jump
+RegisterOpCode compareJumpFor(uint8_t op) {
+    switch (op) {
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+        return ROP_JUMP_IF_NOT_LESS;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST:
+        return ROP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_LOCALS:
+    case OP_JUMP_IF_NOT_GREATER_LOCAL_CONST:
+        return ROP_JUMP_IF_NOT_GREATER;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST:
+        return ROP_JUMP_IF_NOT_GREATER_EQUAL;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL_LOCALS:
+    case OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST:
+        return ROP_JUMP_IF_NOT_EQUAL;
+    default:
+        return ROP_JUMP_IF_EQUAL;
+    }
+}
+
+} // namespace
+
+std::unique_ptr<RegisterChunk> RegisterChunk::translate(const Chunk &chunk,
+                                                        int arity) {
+    auto translated = std::make_unique<RegisterChunk>();
+    std::vector<RegisterInstruction> &code = translated->code;
+    std::vector<int> &offsets = translated->offsets;
+    const uint8_t *bytes = chunk.code;
+
+    // every jump target, with the stack depth there once a forward jump
+    // to it has been seen
+    constexpr int NOT_TARGET = -2;
+    std::vector<int> depthAt(chunk.count + 1, NOT_TARGET);
+    for (int offset = 0; offset < chunk.count;
+         offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0)
+            depthAt[target] = -1;
+    }
+
+    // The stack at each point of the bytecode. A pending entry's value
+    // isn't in its register yet, but in register or constant `operand`;
+    // it's moved there before anything could change that operand, and
+    // wherever control flow joins.
+    struct Entry {
+        bool pending;
+        int operand;
+    };
+    std::vector<Entry> stack(arity + 1, Entry{false, 0});
+    int offset = 0;
+    // the last instruction, while it only computed the top of the stack
+    int producer = -1;
+
+    auto emit = [&](RegisterOpCode op, int a, int b = 0, int c = 0) {
+        code.push_back(RegisterInstruction{op, a, b, c});
+        offsets.push_back(offset);
+        producer = -1;
+    };
+    auto operandOf = [&](int slot) {
+        return stack[slot].pending ? stack[slot].operand : slot;
+    };
+    auto flush = [&](int slot) {
+        if (stack[slot].pending) {
+            stack[slot].pending = false;
+            emit(ROP_MOVE, slot, stack[slot].operand);
+        }
+    };
+    auto flushAll = [&] {
+        for (int slot = 0; slot < static_cast<int>(stack.size()); slot++)
+            flush(slot);
+    };
+    auto pushPending = [&](int operand) {
+        stack.push_back(Entry{true, operand});
+    };
+    auto pushResult = [&](RegisterOpCode op, int b = 0, int c = 0) {
+        int slot = static_cast<int>(stack.size());
+        stack.push_back(Entry{false, 0});
+        emit(op, slot, b, c);
+        producer = static_cast<int>(code.size()) - 1;
+    };
+    auto pop = [&] {
+        // only unreachable code can pop more than it pushed
+        if (stack.empty())
+            return 0;
+        int operand = operandOf(static_cast<int>(stack.size()) - 1);
+        stack.pop_back();
+        return operand;
+    };
+
+    // jump targets are resolved once every instruction's index is known
+    std::vector<int> indexAt(chunk.count + 1, -1);
+    std::vector<std::pair<int, int>> jumps; // (instruction, target offset)
+    auto emitJump = [&](RegisterOpCode op, int b = 0, int c = 0) {
+        int target = jumpTarget(chunk, offset);
+        flushAll();
+        if (target > offset)
+            depthAt[target] = static_cast<int>(stack.size());
+        jumps.emplace_back(code.size(), target);
+        emit(op, 0, b, c);
+    };
+
+    while (offset < chunk.count) {
+        if (depthAt[offset] != NOT_TARGET) {
+            flushAll();
+            producer = -1;
+            if (depthAt[offset] >= 0)
+                stack.resize(depthAt[offset], Entry{false, 0});
+        }
+        indexAt[offset] = static_cast<int>(code.size());
+
+        uint8_t op = bytes[offset];
+        int length = instructionLength(chunk, offset);
+        int top = static_cast<int>(stack.size()) - 1;
+
+        switch (op) {
+        case OP_CONSTANT:
+            pushPending(~bytes[offset + 1]);
+            break;
+        case OP_CONSTANT_LONG:
+            pushPending(~readLong(bytes + offset + 1));
+            break;
+        case OP_NIL:
+            pushResult(ROP_NIL);
+            break;
+        case OP_TRUE:
+            pushResult(ROP_TRUE);
+            break;
+        case OP_FALSE:
+            pushResult(ROP_FALSE);
+            break;
+        case OP_POP:
+            pop();
+            break;
+        case OP_GET_LOCAL:
+            pushPending(operandOf(bytes[offset + 1]));
+            break;
+        case OP_SET_LOCAL: {
+            int slot = bytes[offset + 1];
+            int value = operandOf(top);
+            if (value == slot)
+                break;
+            for (int below = 0; below < top; below++) {
+                if (stack[below].pending && stack[below].operand == slot)
+                    flush(below);
+            }
+            stack[slot].pending = false;
+            if (producer >= 0 && code[producer].a == top &&
+                !stack[top].pending) {
+                // compute the value right into the local
+                code[producer].a = slot;
+                stack[top] = Entry{true, slot};
+            } else {
+                emit(ROP_MOVE, slot, value);
+            }
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            pushResult(ROP_GET_GLOBAL, op == OP_GET_GLOBAL
+                                           ? bytes[offset + 1]
+                                           : readLong(bytes + offset + 1));
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            int name = op == OP_DEFINE_GLOBAL ? bytes[offset + 1]
+                                              : readLong(bytes + offset + 1);
+            emit(ROP_DEFINE_GLOBAL, name, pop());
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG: {
+            int name = op == OP_SET_GLOBAL ? bytes[offset + 1]
+                                           : readLong(bytes + offset + 1);
+            emit(ROP_SET_GLOBAL, name, operandOf(top));
+            break;
+        }
+        case OP_GET_UPVALUE:
+            pushResult(ROP_GET_UPVALUE, bytes[offset + 1]);
+            break;
+        case OP_SET_UPVALUE:
+            emit(ROP_SET_UPVALUE, bytes[offset + 1], operandOf(top));
+            break;
+        case OP_GET_FLAT_UPVALUE:
+            pushResult(ROP_GET_FLAT_UPVALUE, bytes[offset + 1]);
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            int right = pop();
+            int left = pop();
+            pushResult(static_cast<RegisterOpCode>(ROP_EQUAL + op - OP_EQUAL),
+                       left, right);
+            break;
+        }
+        case OP_NOT:
+            pushResult(ROP_NOT, pop());
+            break;
+        case OP_NEGATE:
+            pushResult(ROP_NEGATE, pop());
+            break;
+        case OP_PRINT:
+            emit(ROP_PRINT, pop());
+            break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            emitJump(ROP_JUMP);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            emitJump(ROP_JUMP_IF_FALSE, top);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL: {
+            int right = pop();
+            int left = pop();
+            emitJump(compareJumpFor(op), left, right);
+            break;
+        }
+        case OP_JUMP_IF_NOT_LESS_LOCALS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+        case OP_JUMP_IF_NOT_GREATER_LOCALS:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+        case OP_JUMP_IF_NOT_EQUAL_LOCALS:
+        case OP_JUMP_IF_EQUAL_LOCALS:
+            emitJump(compareJumpFor(op), bytes[offset + 1], bytes[offset + 2]);
+            break;
+        case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_GREATER_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST:
+        case OP_JUMP_IF_EQUAL_LOCAL_CONST:
+            emitJump(compareJumpFor(op), bytes[offset + 1],
+                     ~bytes[offset + 2]);
+            break;
+        case OP_CALL: {
+            int argCount = bytes[offset + 1];
+            int callee = top - argCount;
+            flushAll();
+            emit(ROP_CALL, callee, argCount);
+            stack.resize(callee + 1);
+            break;
+        }
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            int constant = op == OP_CLOSURE ? bytes[offset + 1]
+                                            : readLong(bytes + offset + 1);
+            flushAll();
+            stack.push_back(Entry{false, 0});
+            emit(ROP_CLOSURE, top + 1, constant,
+                 offset + (op == OP_CLOSURE ? 2 : 4));
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            flushAll();
+            emit(ROP_CLOSE_UPVALUE, top);
+            pop();
+            break;
+        case OP_RETURN:
+            emit(ROP_RETURN, pop());
+            break;
+        }
+
+        offset += length;
+    }
+    indexAt[chunk.count] = static_cast<int>(code.size());
+
+    for (auto [index, targetOffset] : jumps) {
+        code[index].a = indexAt[targetOffset];
+    }
+
+    return translated;
+}
+
+} // namespace Clox
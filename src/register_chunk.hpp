@@ -0,0 +1,81 @@
+#ifndef CLOXPP_REGISTER_CHUNK_H
+#define CLOXPP_REGISTER_CHUNK_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "chunk.hpp"
+
+namespace Clox {
+
+// Registers are the slots of the running frame. Operands marked RK are
+// either a register, or the constant `~operand` when they are negative.
+enum RegisterOpCode : uint8_t {
+    ROP_MOVE,             // R(a) = RK(b)
+    ROP_NIL,              // R(a) = nil
+    ROP_TRUE,             // R(a) = true
+    ROP_FALSE,            // R(a) = false
+    ROP_GET_GLOBAL,       // R(a) = the global named by constant b
+    ROP_DEFINE_GLOBAL,    // define the global named by constant a as RK(b)
+    ROP_SET_GLOBAL,       // the global named by constant a = RK(b)
+    ROP_GET_UPVALUE,      // R(a) = upvalue b
+    ROP_SET_UPVALUE,      // upvalue a = RK(b)
+    ROP_GET_FLAT_UPVALUE, // R(a) = the value captured as upvalue b
+    ROP_EQUAL, // R(a) = RK(b) == RK(c), and so on, in OpCode order
+    ROP_GREATER,
+    ROP_LESS,
+    ROP_ADD,
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_NOT,    // R(a) = !RK(b)
+    ROP_NEGATE, // R(a) = -RK(b)
+    ROP_PRINT,  // print RK(a)
+    ROP_JUMP,   // go to instruction a
+    ROP_JUMP_IF_FALSE,     // go to instruction a if RK(b) is falsey
+    ROP_JUMP_IF_NOT_LESS,  // go to instruction a unless RK(b) < RK(c), ...
+    ROP_JUMP_IF_NOT_LESS_EQUAL,
+    ROP_JUMP_IF_NOT_GREATER,
+    ROP_JUMP_IF_NOT_GREATER_EQUAL,
+    ROP_JUMP_IF_NOT_EQUAL,
+    ROP_JUMP_IF_EQUAL,
+    ROP_CALL,          // R(a) = R(a)(R(a + 1), ..., R(a + b))
+    ROP_CLOSURE,       // R(a) = closure of constant b, captures at offset c
+    ROP_CLOSE_UPVALUE, // close the upvalues of R(a) and above
+    ROP_RETURN,        // return RK(a)
+};
+
+struct RegisterInstruction {
+    RegisterOpCode op;
+    int a, b, c;
+};
+
+/*
+ * A chunk translated into three-address instructions over the registers
+ * of its frame. The stack slot a value has at some point of the bytecode
+ * becomes its register, so calls and returns keep the stack VM's calling
+ * convention. Locals and constants are used where they are, instead of
+ * being pushed first, and results go straight into the local they are
+ * assigned to.
+ */
+class RegisterChunk {
+public:
+    // `arity` parameters are in registers 1 to `arity` on entry
+    static std::unique_ptr<RegisterChunk> translate(const Chunk &chunk,
+                                                    int arity);
+
+    const RegisterInstruction *begin() const { return code.data(); }
+    // of the bytecode instruction that `instruction` was translated from
+    int offsetOf(const RegisterInstruction *instruction) const {
+        return offsets[instruction - code.data()];
+    }
+
+private:
+    std::vector<RegisterInstruction> code;
+    std::vector<int> offsets;
+};
+
+} // namespace Clox
+
+#endif // !CLOXPP_REGISTER_CHUNK_H
@@ -1,4 +1,14 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "scanner.hpp"
 #include "token.hpp"
@@ -11,8 +21,206 @@ static bool isalpha(char c) {
 
 static bool isalphanumeric(char c) { return isdigit(c) || isalpha(c); }
 
-Scanner::Scanner(const std::string &source)
-    : source(source), start(source.data()), current(start), line(1) {}
+static bool isblank(char c) {
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+// Runs of whitespace, comments, identifiers and strings are classified a
+// block of bytes at a time, as a mask with one bit per byte, once they
+// turn out to be longer than SHORT_RUN. Most are shorter, and cheaper to
+// go through byte by byte, like the rest of a source shorter than a block.
+static constexpr std::ptrdiff_t SHORT_RUN = 8;
+
+static const char *shortRunEnd(const char *p, const char *end) {
+    return end - p > SHORT_RUN ? p + SHORT_RUN : end;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define SCAN_BLOCKS
+
+#if defined(__AVX2__)
+using Bytes = __m256i;
+static constexpr std::ptrdiff_t BLOCK_SIZE = 32;
+static constexpr uint32_t ALL_BYTES = 0xffffffff;
+
+static Bytes load(const char *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+static uint32_t equal(Bytes bytes, char c) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c)));
+}
+
+// of the bytes from `low` to `high`, which are both ASCII
+static uint32_t within(Bytes bytes, char low, char high) {
+    Bytes above = _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(low - 1));
+    Bytes below = _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), bytes);
+    return _mm256_movemask_epi8(_mm256_and_si256(above, below));
+}
+#else
+using Bytes = __m128i;
+static constexpr std::ptrdiff_t BLOCK_SIZE = 16;
+static constexpr uint32_t ALL_BYTES = 0xffff;
+
+static Bytes load(const char *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+static uint32_t equal(Bytes bytes, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// of the bytes from `low` to `high`, which are both ASCII
+static uint32_t within(Bytes bytes, char low, char high) {
+    Bytes above = _mm_cmpgt_epi8(bytes, _mm_set1_epi8(low - 1));
+    Bytes below = _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), bytes);
+    return _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+#endif
+
+// of the bytes before the first one set in `mask`, which isn't empty
+static uint32_t before(uint32_t mask) {
+    return (mask & -mask) - 1;
+}
+#endif
+
+// Skips spaces, tabs and line breaks from `p`, counting the line breaks
+// into `lines`.
+static const char *skipBlanks(const char *p, const char *end,
+                              std::size_t &lines) {
+    std::size_t count = 0;
+    for (const char *shortEnd = shortRunEnd(p, end); p != shortEnd; p++) {
+        if (!isblank(*p)) {
+            lines += count;
+            return p;
+        }
+        count += *p == '\n';
+    }
+#ifdef SCAN_BLOCKS
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        Bytes bytes = load(p);
+        uint32_t newlines = equal(bytes, '\n');
+        uint32_t others = ~(equal(bytes, ' ') | equal(bytes, '\r') |
+                            equal(bytes, '\t') | newlines) &
+                          ALL_BYTES;
+        if (others) {
+            lines += count + __builtin_popcount(newlines & before(others));
+            return p + __builtin_ctz(others);
+        }
+        count += __builtin_popcount(newlines);
+    }
+#endif
+    for (; p != end && isblank(*p); p++)
+        count += *p == '\n';
+    lines += count;
+    return p;
+}
+
+// Finds the line break ending the line `p` is on, or the end.
+static const char *findLineEnd(const char *p, const char *end) {
+    for (const char *shortEnd = shortRunEnd(p, end); p != shortEnd; p++) {
+        if (*p == '\n')
+            return p;
+    }
+#ifdef SCAN_BLOCKS
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        uint32_t newlines = equal(load(p), '\n');
+        if (newlines)
+            return p + __builtin_ctz(newlines);
+    }
+#endif
+    while (p != end && *p != '\n')
+        p++;
+    return p;
+}
+
+// Finds the next '"' from `p`, or the end, counting the line breaks
+// before it into `lines`.
+static const char *findQuote(const char *p, const char *end,
+                             std::size_t &lines) {
+    std::size_t count = 0;
+    for (const char *shortEnd = shortRunEnd(p, end); p != shortEnd; p++) {
+        if (*p == '"') {
+            lines += count;
+            return p;
+        }
+        count += *p == '\n';
+    }
+#ifdef SCAN_BLOCKS
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        Bytes bytes = load(p);
+        uint32_t newlines = equal(bytes, '\n');
+        uint32_t quotes = equal(bytes, '"');
+        if (quotes) {
+            lines += count + __builtin_popcount(newlines & before(quotes));
+            return p + __builtin_ctz(quotes);
+        }
+        count += __builtin_popcount(newlines);
+    }
+#endif
+    for (; p != end && *p != '"'; p++)
+        count += *p == '\n';
+    lines += count;
+    return p;
+}
+
+// Finds the next '"' or '/' from `p`, or the end, counting the line
+// breaks before it into `lines`. Those are all that tell whether a line
+// starts inside a string.
+static const char *findStringOrComment(const char *p, const char *end,
+                                       std::size_t &lines) {
+    std::size_t count = 0;
+#ifdef SCAN_BLOCKS
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        Bytes bytes = load(p);
+        uint32_t newlines = equal(bytes, '\n');
+        uint32_t found = equal(bytes, '"') | equal(bytes, '/');
+        if (found) {
+            lines += count + __builtin_popcount(newlines & before(found));
+            return p + __builtin_ctz(found);
+        }
+        count += __builtin_popcount(newlines);
+    }
+#endif
+    for (; p != end && *p != '"' && *p != '/'; p++)
+        count += *p == '\n';
+    lines += count;
+    return p;
+}
+
+// Skips the letters, digits and underscores from `p`.
+static const char *skipIdentifier(const char *p, const char *end) {
+    for (const char *shortEnd = shortRunEnd(p, end); p != shortEnd; p++) {
+        if (!isalphanumeric(*p))
+            return p;
+    }
+#ifdef SCAN_BLOCKS
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        Bytes bytes = load(p);
+        uint32_t others = ~(within(bytes, 'a', 'z') | within(bytes, 'A', 'Z') |
+                            within(bytes, '0', '9') | equal(bytes, '_')) &
+                          ALL_BYTES;
+        if (others)
+            return p + __builtin_ctz(others);
+    }
+#endif
+    while (p != end && isalphanumeric(*p))
+        p++;
+    return p;
+}
+
+// the messages of ERROR tokens, which CompactToken refers to by index
+static const char *const ERROR_MESSAGES[] = {
+    "Unexpected character.",
+    "Unterminated string.",
+};
+
+enum ErrorMessage { UNEXPECTED_CHARACTER, UNTERMINATED_STRING };
+
+Scanner::Scanner(std::string_view source, std::size_t offset,
+                 std::size_t line)
+    : source(source.data()), start(source.data() + offset), current(start),
+      end(source.data() + source.size()), line(line) {}
 
 Token Scanner::scanOneToken() {
     skipWhitespace();
@@ -67,7 +275,34 @@ Token Scanner::scanOneToken() {
     if (isAtEnd())
         return createToken(TokenType::EOF_);
 
-    return createErrorToken("Unexpected character.");
+    return createErrorToken(ERROR_MESSAGES[UNEXPECTED_CHARACTER]);
+}
+
+std::size_t Scanner::scanBatch(CompactToken *tokens, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) {
+        Token token = scanOneToken();
+        uint32_t offset;
+        if (token.type == TokenType::ERROR) {
+            offset = std::find(std::begin(ERROR_MESSAGES),
+                               std::end(ERROR_MESSAGES), token.lexeme.data()) -
+                     std::begin(ERROR_MESSAGES);
+        } else {
+            offset = token.lexeme.data() - source;
+        }
+        tokens[i] = {offset, static_cast<uint32_t>(token.lexeme.size()),
+                     static_cast<uint32_t>(token.line), token.type};
+        if (token.type == TokenType::EOF_)
+            return i + 1;
+    }
+    return count;
+}
+
+Token Scanner::expand(const CompactToken &token) const {
+    std::string_view lexeme =
+        token.type == TokenType::ERROR
+            ? std::string_view(ERROR_MESSAGES[token.offset])
+            : std::string_view(source + token.offset, token.length);
+    return Token(token.type, lexeme, token.line);
 }
 
 Token Scanner::createToken(TokenType type) {
@@ -86,43 +321,18 @@ Token Scanner::createErrorToken(const char *message) {
 
 void Scanner::skipWhitespace() {
     for (;;) {
-        char c = peek();
-        switch (c) {
-        case ' ':
-        case '\r':
-        case '\t': {
-            advance();
-            break;
-        }
-        case '\n': {
-            line++;
-            advance();
-            break;
-        }
-        case '/': { // handle comment
-            if (peekNext() == '/') {
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
-            } else {
-                return;
-            }
-            break;
-        }
-        default:
+        current = skipBlanks(current, end, line);
+        if (peek() != '/' || peekNext() != '/')
             return;
-        }
+        current = findLineEnd(current + 2, end); // a comment
     }
 }
 
 Token Scanner::consumeString() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n')
-            line++;
-        advance();
-    }
+    current = findQuote(current, end, line);
 
     if (isAtEnd()) {
-        return createErrorToken("Unterminated string.");
+        return createErrorToken(ERROR_MESSAGES[UNTERMINATED_STRING]);
     }
 
     advance(); // The closing quote
@@ -144,78 +354,74 @@ Token Scanner::consumeNumber() {
     return createToken(TokenType::NUMBER);
 }
 
-TokenType Scanner::checkKeyword(std::size_t start, std::size_t length,
-                                const char *rest, TokenType type) {
-    if (static_cast<std::size_t>(this->current - this->start) ==
-            start + length &&
-        std::memcmp(this->start + start, rest, length) == 0) {
-        return type;
-    }
+// Keywords are found by a perfect hash of their length and their first
+// and last characters, built at compile time, and then compared once.
+struct Keyword {
+    const char *name;
+    std::size_t length; // 0 for the empty slots of KeywordTable
+    TokenType type;
+};
+
+static constexpr Keyword KEYWORDS[] = {
+    {"and", 3, TokenType::AND},       {"class", 5, TokenType::CLASS},
+    {"else", 4, TokenType::ELSE},     {"false", 5, TokenType::FALSE},
+    {"for", 3, TokenType::FOR},       {"fun", 3, TokenType::FUN},
+    {"if", 2, TokenType::IF},         {"nil", 3, TokenType::NIL},
+    {"or", 2, TokenType::OR},         {"print", 5, TokenType::PRINT},
+    {"return", 6, TokenType::RETURN}, {"super", 5, TokenType::SUPER},
+    {"this", 4, TokenType::THIS},     {"true", 4, TokenType::TRUE},
+    {"var", 3, TokenType::VAR},       {"while", 5, TokenType::WHILE},
+};
+
+static constexpr std::size_t KEYWORD_MIN_LENGTH = 2;
+static constexpr std::size_t KEYWORD_MAX_LENGTH = 6;
+
+static constexpr std::size_t keywordHash(char first, char last,
+                                         std::size_t length) {
+    return (static_cast<unsigned char>(first) +
+            static_cast<unsigned char>(last) * 5 + length) &
+           31;
+}
 
-    return TokenType::IDENTIFIER;
+struct KeywordTable {
+    Keyword slots[32];
+    bool collides; // if two keywords hash to the same slot
+};
+
+static constexpr KeywordTable makeKeywordTable() {
+    KeywordTable table{};
+    for (const Keyword &keyword : KEYWORDS) {
+        Keyword &slot = table.slots[keywordHash(
+            keyword.name[0], keyword.name[keyword.length - 1], keyword.length)];
+        table.collides |= slot.length != 0;
+        slot = keyword;
+    }
+    return table;
 }
 
+static constexpr KeywordTable KEYWORD_TABLE = makeKeywordTable();
+static_assert(!KEYWORD_TABLE.collides, "keywordHash must be perfect");
+
 TokenType Scanner::identifierType() {
-    switch (*start) {
-    case 'a':
-        return checkKeyword(1, 2, "nd", TokenType::AND);
-    case 'c':
-        return checkKeyword(1, 4, "lass", TokenType::CLASS);
-    case 'e':
-        return checkKeyword(1, 3, "lse", TokenType::ELSE);
-    case 'f': {
-        if (static_cast<std::size_t>(current - start) > 1) {
-            switch (*(start + 1)) {
-            case 'a':
-                return checkKeyword(2, 3, "lse", TokenType::FALSE);
-            case 'o':
-                return checkKeyword(2, 1, "r", TokenType::FOR);
-            case 'u':
-                return checkKeyword(2, 1, "n", TokenType::FUN);
-            }
-        }
-        break;
-    }
-    case 'i':
-        return checkKeyword(1, 1, "f", TokenType::IF);
-    case 'n':
-        return checkKeyword(1, 2, "il", TokenType::NIL);
-    case 'o':
-        return checkKeyword(1, 1, "r", TokenType::OR);
-    case 'p':
-        return checkKeyword(1, 4, "rint", TokenType::PRINT);
-    case 'r':
-        return checkKeyword(1, 5, "eturn", TokenType::RETURN);
-    case 's':
-        return checkKeyword(1, 4, "uper", TokenType::SUPER);
-    case 't': {
-        if (static_cast<std::size_t>(current - start) > 1) {
-            switch (*(start + 1)) {
-            case 'h':
-                return checkKeyword(2, 2, "is", TokenType::THIS);
-            case 'r':
-                return checkKeyword(2, 2, "ue", TokenType::TRUE);
-            }
-        }
-        break;
+    std::size_t length = current - start;
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+        return TokenType::IDENTIFIER;
+
+    const Keyword &keyword =
+        KEYWORD_TABLE.slots[keywordHash(start[0], start[length - 1], length)];
+    if (keyword.length == length &&
+        std::memcmp(start, keyword.name, length) == 0) {
+        return keyword.type;
     }
-    case 'v':
-        return checkKeyword(1, 2, "ar", TokenType::VAR);
-    case 'w':
-        return checkKeyword(1, 4, "hile", TokenType::WHILE);
-    }
-
     return TokenType::IDENTIFIER;
 }
 
 Token Scanner::consumeIdentifier() {
-    while (isalphanumeric(peek()))
-        advance();
-
+    current = skipIdentifier(current, end);
     return createToken(identifierType());
 }
 
-bool Scanner::isAtEnd() { return *current == '\0'; }
+bool Scanner::isAtEnd() { return current == end; }
 
 char Scanner::advance() {
     if (isAtEnd()) {
@@ -247,8 +453,98 @@ char Scanner::peek() {
 }
 
 char Scanner::peekNext() {
-    if (isAtEnd())
+    if (end - current < 2)
         return '\0';
 
     return *(current + 1);
 }
+
+TokenStream TokenStream::forSource(std::string_view source) {
+    unsigned threads = std::thread::hardware_concurrency();
+    if (source.size() >= PARALLEL_SCAN_SIZE && threads > 1)
+        return scanInParallel(source, threads);
+    return TokenStream(source);
+}
+
+TokenStream TokenStream::scanInParallel(std::string_view source,
+                                        unsigned threads) {
+    // Split the source into about equal parts, each starting on a line
+    // that doesn't start inside a string, and note which line that is.
+    struct Part {
+        std::size_t offset;
+        std::size_t line;
+        std::vector<CompactToken> tokens;
+    };
+    std::vector<Part> parts{{0, 1, {}}};
+    const std::size_t partSize = source.size() / std::max(threads, 1u) + 1;
+    const char *end = source.data() + source.size();
+    const char *p = source.data();
+    std::size_t line = 1;
+    for (;;) {
+        // any line starting before the next string or comment will do
+        const char *counted = p;
+        std::size_t countedLine = line;
+        const char *stringOrComment = findStringOrComment(p, end, line);
+        std::size_t limit = stringOrComment - source.data();
+        for (;;) {
+            std::size_t from = std::max<std::size_t>(
+                parts.back().offset + partSize - 1, counted - source.data());
+            auto lineEnd = static_cast<const char *>(
+                from < limit ? std::memchr(source.data() + from, '\n',
+                                           limit - from)
+                             : nullptr);
+            if (!lineEnd)
+                break;
+            countedLine += std::count(counted, lineEnd + 1, '\n');
+            counted = lineEnd + 1;
+            std::size_t offset = counted - source.data();
+            parts.push_back({offset, countedLine, {}});
+        }
+
+        p = stringOrComment;
+        if (p == end) {
+            break;
+        } else if (*p == '"') {
+            p = findQuote(p + 1, end, line);
+            p += p != end;
+        } else if (end - p > 1 && p[1] == '/') {
+            p = findLineEnd(p + 2, end);
+        } else {
+            p++;
+        }
+    }
+
+    auto scanPart = [source, &parts](std::size_t i) {
+        Part &part = parts[i];
+        bool last = i + 1 == parts.size();
+        std::size_t partEnd = last ? source.size() : parts[i + 1].offset;
+        Scanner scanner(source.substr(0, partEnd), part.offset, part.line);
+        // typical code has a token every four bytes or so
+        part.tokens.reserve((partEnd - part.offset) / 4 + BATCH_SIZE);
+        CompactToken batch[BATCH_SIZE];
+        for (;;) {
+            std::size_t count = scanner.scanBatch(batch, BATCH_SIZE);
+            part.tokens.insert(part.tokens.end(), batch, batch + count);
+            if (part.tokens.back().type == TokenType::EOF_)
+                break;
+        }
+        if (!last)
+            part.tokens.pop_back(); // the EOF at the end of the part
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < parts.size(); i++)
+        workers.emplace_back(scanPart, i);
+    scanPart(0);
+    for (std::thread &worker : workers)
+        worker.join();
+
+    auto tokens = std::make_shared<std::vector<std::vector<CompactToken>>>();
+    for (Part &part : parts) {
+        if (!part.tokens.empty())
+            tokens->push_back(std::move(part.tokens));
+    }
+
+    TokenStream stream(source, source.size());
+    stream.scanned = std::move(tokens);
+    return stream;
+}
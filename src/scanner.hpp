@@ -1,23 +1,36 @@
 #ifndef CLOXPP_SCANNER_H
 #define CLOXPP_SCANNER_H
 
-#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
 
 #include "token.hpp"
 
+// A token in 16 bytes, with its lexeme as an offset into the source.
+// ERROR tokens have the index of their message in `offset` instead.
+struct CompactToken {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t line;
+    TokenType type;
+};
+static_assert(sizeof(CompactToken) == 16);
+
 class Scanner {
 private:
-    const std::string &source;
+    const char *source;
     const char *start;
     const char *current;
+    const char *end;
     std::size_t line;
 
     Token createToken(TokenType type);
     Token createToken(TokenType type, std::string_view lexeme);
     Token createErrorToken(const char *message);
     void skipWhitespace();
-    TokenType checkKeyword(std::size_t start, std::size_t length,
-                           const char *rest, TokenType type);
     TokenType identifierType();
     Token consumeString();
     Token consumeNumber();
@@ -29,8 +42,72 @@ private:
     char peekNext();
 
 public:
-    Scanner(const std::string &source);
+    // start scanning at `offset`, which is on line `line`
+    Scanner(std::string_view source, std::size_t offset = 0,
+            std::size_t line = 1);
     Token scanOneToken();
+
+    // scan up to `count` tokens into `tokens`, stopping after EOF, and
+    // return how many there are; sources are limited to 4 GB, which
+    // SourceFile enforces
+    std::size_t scanBatch(CompactToken *tokens, std::size_t count);
+    // the token that `token` from `scanBatch` stands for
+    Token expand(const CompactToken &token) const;
+};
+
+/*
+ * The tokens of a source, scanned ahead in batches into a buffer and
+ * read from it one at a time, which spares the parsers a call into the
+ * scanner per token. Copies continue from the same point independently.
+ */
+class TokenStream {
+public:
+    explicit TokenStream(std::string_view source, std::size_t offset = 0,
+                         std::size_t line = 1)
+        : scanner(source, offset, line), size(0), position(0), part(0) {}
+
+    // the tokens of all of `source`, scanned up front in parallel when it
+    // is large and there is more than one core
+    static TokenStream forSource(std::string_view source);
+    // the tokens of all of `source`, scanned up front by `threads` threads
+    // from lines starting outside of strings
+    static TokenStream scanInParallel(std::string_view source,
+                                      unsigned threads);
+
+    Token next() {
+        if (scanned) {
+            const std::vector<CompactToken> &tokens = (*scanned)[part];
+            const CompactToken &token = tokens[position++];
+            if (position == tokens.size()) {
+                // the final EOF repeats, as it does from a scanner
+                if (part + 1 < scanned->size()) {
+                    part++;
+                    position = 0;
+                } else {
+                    position--;
+                }
+            }
+            return scanner.expand(token);
+        }
+        if (position == size) {
+            size = scanner.scanBatch(batch, BATCH_SIZE);
+            position = 0;
+        }
+        return scanner.expand(batch[position++]);
+    }
+
+private:
+    static constexpr std::size_t BATCH_SIZE = 256;
+    // below this, starting threads costs more than they save
+    static constexpr std::size_t PARALLEL_SCAN_SIZE = 4 * 1024 * 1024;
+
+    Scanner scanner; // only expands tokens if they were `scanned`
+    CompactToken batch[BATCH_SIZE];
+    std::size_t size;
+    std::size_t position; // in `scanned[part]` if set, else in `batch`
+    // the tokens scanned up front, by part of the source, none empty
+    std::shared_ptr<const std::vector<std::vector<CompactToken>>> scanned;
+    std::size_t part;
 };
 
 #endif // !CLOXPP_SCANNER_H
@@ -1,25 +1,138 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <stdexcept>
 
+#include "bytecode_cache.hpp"
+#include "compiler.hpp"
+#include "heap_snapshot.hpp"
 #include "stack_vm.hpp"
 #include "utils.hpp"
 
 namespace Clox {
 
-void StackVM::runFile(const char *path) {
-    auto result = vm.interpret(readFile(path));
+void StackVM::enableBytecodeCache(const std::string &cacheDir) {
+    useBytecodeCache = true;
+    bytecodeCacheDir = cacheDir;
+}
+
+void StackVM::enableLazyCompilation() { lazyCompilation = true; }
+
+void StackVM::enableLoadTiming() { reportLoadTime = true; }
+
+void StackVM::enablePredecoding() { vm.enablePredecoding(); }
+
+void StackVM::enableStackCaching() { vm.enableStackCaching(); }
+
+void StackVM::enableRegisters() { vm.enableRegisters(); }
+
+void StackVM::setFlushPolicy(OutputBuffer::FlushPolicy policy) {
+    vm.setFlushPolicy(policy);
+}
+
+void StackVM::captureOutput(std::string &output, std::FILE *errors) {
+    vm.captureOutput(output);
+    vm.setErrorStream(errors);
+    this->errors = errors;
+}
+
+void StackVM::bootFromSnapshot(const std::string &path) {
+    snapshotPath = path;
+}
+
+bool StackVM::saveSnapshot(const std::string &path) {
+    if (!HeapSnapshot::save(vm, path)) {
+        std::fprintf(errors, "Could not save heap snapshot %s\n",
+                     path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool StackVM::boot() {
+    if (snapshotPath.empty() || HeapSnapshot::load(vm, snapshotPath))
+        return true;
+    std::fprintf(errors, "Could not load heap snapshot %s\n",
+                 snapshotPath.c_str());
+    return false;
+}
+
+int StackVM::runScript(const char *path) {
+    if (!boot())
+        return 74;
+
+    // compile, or load from the cache, straight into the VM's heap
+    Heap::Scope scope(vm.getHeap());
+    auto loadStart = std::chrono::steady_clock::now();
+    std::unique_ptr<SourceFile> file;
+    try {
+        file = std::make_unique<SourceFile>(path);
+    } catch (const std::ios_base::failure &) {
+        std::fprintf(errors, "Could not open file \"%s\".\n", path);
+        return 74;
+    } catch (const std::length_error &error) {
+        std::fprintf(errors, "Could not load \"%s\": %s.\n", path,
+                     error.what());
+        return 74;
+    }
+    std::string_view source = file->text();
 
+    ObjFunction *script;
+    if (useBytecodeCache) {
+        auto cachePath = BytecodeCache::pathFor(path, source, bytecodeCacheDir);
+        bytecodeImage = BytecodeImage::map(cachePath);
+        script = bytecodeImage ? BytecodeCache::load(*bytecodeImage, source)
+                               : nullptr;
+        if (!script) {
+            // the cache stores bytecode for every function, so there is
+            // nothing to gain from compiling lazily here
+            script =
+                SinglePassCompiler::compile(source, /*lazy=*/false, errors);
+            if (script) {
+                // failing to write the cache only costs the next run time
+                BytecodeCache::store(cachePath, source, script);
+            }
+        }
+    } else {
+        script = SinglePassCompiler::compile(source, lazyCompilation, errors);
+    }
+
+    if (reportLoadTime) {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - loadStart;
+        auto lines = std::count(source.begin(), source.end(), '\n');
+        std::fprintf(errors, "loaded %s in %g ms, %g lines/s\n", path,
+                     elapsed.count() * 1000, lines / elapsed.count());
+    }
+
+    InterpretResult result =
+        script ? vm.interpret(script) : InterpretResult::COMPILE_ERROR;
     if (result == InterpretResult::COMPILE_ERROR)
-        std::exit(65);
+        return 65;
     if (result == InterpretResult::RUNTIME_ERROR)
-        std::exit(70);
+        return 70;
+    return 0;
+}
+
+void StackVM::runFile(const char *path) {
+    int status = runScript(path);
+    if (status != 0)
+        std::exit(status);
 }
 
 void StackVM::runPrompt() {
+    if (!boot())
+        std::exit(74);
+    Heap::Scope scope(vm.getHeap());
     std::string line;
     while (std::cin) {
         std::cout << ">>> ";
         std::getline(std::cin, line);
-        vm.interpret(line);
+        ObjFunction *script =
+            SinglePassCompiler::compile(line, lazyCompilation);
+        if (script)
+            vm.interpret(script);
     }
 }
 
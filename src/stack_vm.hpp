@@ -1,6 +1,11 @@
 #ifndef CLOXPP_STACK_VM_H
 #define CLOXPP_STACK_VM_H
 
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "bytecode_cache.hpp"
 #include "vm.hpp"
 
 namespace Clox {
@@ -9,11 +14,56 @@ class StackVM {
 public:
     StackVM() = default;
 
+    // cache compiled scripts run by `runFile`; an empty `cacheDir` puts
+    // the cache next to each script
+    void enableBytecodeCache(const std::string &cacheDir);
+    // compile top-level function bodies only when they are first called
+    void enableLazyCompilation();
+    // report how long `runFile` takes from opening the script to running
+    // its first instruction, and how many lines per second that is, on
+    // stderr
+    void enableLoadTiming();
+    // run code pre-decoded into fixed-width instructions
+    void enablePredecoding();
+    // cache the top of the stack in a register while running bytecode
+    void enableStackCaching();
+    // run code translated into three-address register instructions
+    void enableRegisters();
+    // write printed output out at every line, or only in large blocks
+    void setFlushPolicy(OutputBuffer::FlushPolicy policy);
+    // keep printed output in `output` and report errors on `errors`,
+    // instead of stdout and stderr
+    void captureOutput(std::string &output, std::FILE *errors);
+
+    // restore the globals saved by `saveSnapshot` before the script or
+    // prompt starts; a snapshot that can't be loaded fails the script with
+    // status 74
+    void bootFromSnapshot(const std::string &path);
+    // save the globals left behind by `runFile`
+    // or reports why it couldn't and returns false
+    bool saveSnapshot(const std::string &path);
+
+    // returns the exit status for the script at `path`: 0, 65 after a
+    // compile error, 70 after a runtime error or 74 if it can't be read
+    int runScript(const char *path);
+    // exits with the status from `runScript` unless it is 0
     void runFile(const char *path);
     void runPrompt();
 
 private:
+    // declared before `vm`, so that it is unmapped only after the VM has
+    // freed everything loaded from it
+    std::unique_ptr<BytecodeImage> bytecodeImage;
     VM vm{};
+    bool useBytecodeCache = false;
+    bool lazyCompilation = false;
+    bool reportLoadTime = false;
+    std::FILE *errors = stderr;
+    std::string bytecodeCacheDir;
+    std::string snapshotPath; // to boot from, if not empty
+
+    // loads the snapshot to boot from, if any
+    bool boot();
 };
 
 } // namespace Clox
@@ -13,7 +13,7 @@ Table::Table() : count(0), capacity(0), entries(nullptr) {}
 
 Table::~Table() {
     if (entries) {
-        Allocator::freeArray<Entry>(entries, count);
+        Allocator::freeArray<Entry>(entries, capacity);
         count = 0;
         capacity = 0;
     }
@@ -86,6 +86,8 @@ void Table::adjustCapacity(int newCapacity) {
         newEntries[i] = {};
     }
 
+    // tombstones are dropped, so count only the entries carried over
+    count = 0;
     for (int i = 0; i < capacity; i++) {
         auto *entry = &entries[i];
         if (!entry->key)
@@ -103,11 +105,19 @@ void Table::adjustCapacity(int newCapacity) {
 
 Entry *Table::findEntry(Entry *entries, int capacity, ObjString *key) {
     uint32_t index = key->getHash() % capacity;
+    Entry *tombstone = nullptr;
     for (;;) {
         auto *entry = &entries[index];
 
-        if (!entry->isTombstone() || entry->key == key)
+        if (entry->key == nullptr) {
+            // reuse the first tombstone passed, if any
+            if (!entry->isTombstone())
+                return tombstone ? tombstone : entry;
+            if (!tombstone)
+                tombstone = entry;
+        } else if (entry->key == key) {
             return entry;
+        }
 
         index = (index + 1) % capacity;
     }
@@ -28,6 +28,16 @@ public:
     bool deleteKey(ObjString *key);
     ObjString *findString(const char *chars, int length, uint32_t hash) const;
 
+    // call `fn(key, value)` for every entry in the table
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (int i = 0; i < capacity; i++) {
+            if (entries[i].key) {
+                fn(entries[i].key, entries[i].value);
+            }
+        }
+    }
+
 private:
     static constexpr auto TABLE_MAX_LOAD = 0.75;
     static Entry *findEntry(Entry *entries, int capacity, ObjString *key);
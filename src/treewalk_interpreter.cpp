@@ -15,7 +15,8 @@ TreewalkInterpreter::TreewalkInterpreter()
       interpreter(Interpreter(*errorHandler.get())) {}
 
 void TreewalkInterpreter::runFile(const char *path) {
-    run(readFile(path));
+    SourceFile source(path);
+    run(source.text());
 
     if (errorHandler->hadError) {
         std::exit(65);
@@ -25,25 +26,8 @@ void TreewalkInterpreter::runFile(const char *path) {
     }
 }
 
-void TreewalkInterpreter::run(const std::string &source) {
-    auto scanner = Scanner(source);
-    auto tokens = std::vector<Token>();
-    for (;;) {
-        Token token = scanner.scanOneToken();
-        if (token.type == TokenType::ERROR) {
-            errorHandler->error(token.line, token.getLexemeString().data());
-            break;
-        }
-
-        tokens.push_back(token);
-        if (token.type == TokenType::EOF_) {
-            break;
-        }
-    }
-    if (errorHandler->hadError) {
-        return;
-    }
-
+void TreewalkInterpreter::run(std::string_view source) {
+    auto tokens = TokenStream::forSource(source);
     auto parser = Parser(tokens, *errorHandler.get());
     auto statements = parser.parse();
 
@@ -2,7 +2,7 @@
 #define CLOXPP_TREEWALK_INTERPRETER_H
 
 #include <memory>
-#include <string>
+#include <string_view>
 
 #include "error_handler.hpp"
 #include "interpreter.hpp"
@@ -13,7 +13,7 @@ class TreewalkInterpreter {
 public:
     TreewalkInterpreter();
 
-    void run(const std::string &source);
+    void run(std::string_view source);
     void runFile(const char *path);
     void runPrompt();
 
@@ -1,12 +1,64 @@
-#include <fstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <ios>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "utils.hpp"
 
-std::string readFile(const char *path) {
-    std::ifstream ifs(path, std::ios::in | std::ios::binary);
-    if (!ifs) {
+SourceFile::SourceFile(const char *path) : mapping(nullptr), size(0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         throw std::ios_base::failure("File does not exist!");
     }
-    std::string source(std::istreambuf_iterator<char>{ifs}, {});
-    return source;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (static_cast<std::size_t>(st.st_size) > MAX_SIZE) {
+            close(fd);
+            throw std::length_error("Source file is larger than 4 GB");
+        }
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // the scanner goes through it once, front to back
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            mapping = data;
+            size = st.st_size;
+            close(fd);
+            return;
+        }
+    }
+
+    char buffer[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            // a directory, say, opens fine but can't be read
+            close(fd);
+            throw std::ios_base::failure("File could not be read!");
+        }
+        if (n == 0)
+            break;
+        contents.append(buffer, n);
+        if (contents.size() > MAX_SIZE) {
+            close(fd);
+            throw std::length_error("Source file is larger than 4 GB");
+        }
+    }
+    close(fd);
+}
+
+SourceFile::~SourceFile() {
+    if (mapping)
+        munmap(mapping, size);
+}
+
+std::string_view SourceFile::text() const {
+    if (mapping)
+        return std::string_view(static_cast<const char *>(mapping), size);
+    return contents;
 }
@@ -1,8 +1,35 @@
 #ifndef CLOXPP_UTILS_H
 #define CLOXPP_UTILS_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
-std::string readFile(const char *path);
+/*
+ * The contents of a source file. Regular files are mapped read-only and
+ * scanned in place; anything that can't be mapped, like a pipe or
+ * /dev/stdin, is read into memory instead. Tokens point into the text,
+ * so it must outlive them.
+ */
+class SourceFile {
+public:
+    // the scanner keeps offsets into the text in 32 bits
+    static constexpr std::size_t MAX_SIZE = UINT32_MAX;
+
+    // throws std::ios_base::failure if `path` can't be opened or read, and
+    // std::length_error if it holds more than MAX_SIZE bytes
+    explicit SourceFile(const char *path);
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile();
+
+    std::string_view text() const;
+
+private:
+    void *mapping; // or nullptr if the file was read into `contents`
+    std::size_t size;
+    std::string contents;
+};
 
 #endif // !CLOXPP_UTILS_H
@@ -1,6 +1,21 @@
+#include <charconv>
+#include <cstring>
+
 #include "value.hpp"
 #include "lox_class.hpp"
 #include "memory.hpp"
+#include "output_buffer.hpp"
+
+// the longest number printed is -1.79769e+308
+static constexpr std::size_t NUMBER_BUFFER_SIZE = 13;
+
+// Writes `num` exactly as printf's %g directive does, returning the length.
+// This neither allocates nor goes through the C locale.
+static std::size_t formatNumber(char *buffer, double num) {
+    auto result = std::to_chars(buffer, buffer + NUMBER_BUFFER_SIZE, num,
+                                std::chars_format::general, 6);
+    return result.ptr - buffer;
+}
 
 namespace Jlox {
 
@@ -8,9 +23,8 @@ struct ToStringVisitor {
     std::string operator()(std::monostate) { return "nil"; }
     std::string operator()(const std::string &str) { return str; };
     std::string operator()(double d) {
-        char buffer[13]; // %g directive writes between 1 and 13 bytes
-        std::sprintf(buffer, "%g", d);
-        return std::string(buffer);
+        char buffer[NUMBER_BUFFER_SIZE];
+        return std::string(buffer, formatNumber(buffer, d));
     }
     std::string operator()(bool b) { return b ? "true" : "false"; }
     std::string operator()(const LoxCallablePtr &callable) {
@@ -22,14 +36,36 @@ struct ToStringVisitor {
 };
 
 std::ostream &operator<<(std::ostream &os, const Value &value) {
+    if (std::holds_alternative<double>(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        return os.write(buffer, formatNumber(buffer, std::get<double>(value)));
+    }
+
     os << std::visit(ToStringVisitor(), value);
     return os;
 }
 
+OutputBuffer &operator<<(OutputBuffer &out, const Value &value) {
+    if (std::holds_alternative<double>(value)) {
+        char *buffer = out.reserve(NUMBER_BUFFER_SIZE);
+        out.commit(formatNumber(buffer, std::get<double>(value)));
+        return out;
+    } else if (std::holds_alternative<std::string>(value)) {
+        return out << std::string_view(std::get<std::string>(value));
+    }
+
+    std::string text = std::visit(ToStringVisitor(), value);
+    return out << std::string_view(text);
+}
+
 } // namespace Jlox
 
 namespace Clox {
 
+Number addDoubles(Number a, Number b) { return a + b; }
+
+Number multiplyDoubles(Number a, Number b) { return a * b; }
+
 ValueArray::ValueArray() : capacity(0), count(0), values(nullptr) {}
 
 ValueArray::~ValueArray() {
@@ -49,12 +85,35 @@ void ValueArray::write(Value value) {
     count++;
 }
 
+// Writes `num` the way %g writes it as a double, returning the length.
+// %g only switches to an exponent from 7 digits on.
+static std::size_t formatInteger(char *buffer, Integer num) {
+    if (num <= -1000000 || num >= 1000000)
+        return formatNumber(buffer, static_cast<Number>(num));
+
+    char *end = buffer + 7;
+    char *p = end;
+    auto magnitude = static_cast<uint32_t>(num < 0 ? -num : num);
+    do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (num < 0)
+        *--p = '-';
+    std::size_t length = end - p;
+    std::memmove(buffer, p, length);
+    return length;
+}
+
 struct ToStringVisitor {
     std::string operator()(Nil) { return "nil"; }
     std::string operator()(Number num) {
-        char buffer[13]; // %g directive writes between 1 and 13 bytes
-        std::sprintf(buffer, "%g", num);
-        return std::string(buffer);
+        char buffer[NUMBER_BUFFER_SIZE];
+        return std::string(buffer, formatNumber(buffer, num));
+    }
+    std::string operator()(Integer num) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        return std::string(buffer, formatInteger(buffer, num));
     }
     std::string operator()(bool b) { return b ? "true" : "false"; }
     std::string operator()(const ObjString *str) {
@@ -84,6 +143,10 @@ struct ValueEquality {
         return a == b;
     }
 
+    // an Integer equals the Number with the same value
+    bool operator()(Integer a, Number b) const { return a == b; }
+    bool operator()(Number a, Integer b) const { return a == b; }
+
     template <typename T, typename U,
               typename = std::enable_if_t<!std::is_same_v<T, U>>>
     bool operator()(T /*a*/, U /*b*/) const {
@@ -100,8 +163,34 @@ bool Value::isFalsey() const {
 }
 
 std::ostream &operator<<(std::ostream &os, const Value &value) {
+    // numbers are printed often enough to skip building a string
+    char buffer[NUMBER_BUFFER_SIZE];
+    if (value.isType<Integer>()) {
+        return os.write(buffer, formatInteger(buffer, value.asType<Integer>()));
+    } else if (value.isType<Number>()) {
+        return os.write(buffer, formatNumber(buffer, value.asType<Number>()));
+    }
+
     os << std::visit(ToStringVisitor(), value);
     return os;
 }
 
+OutputBuffer &operator<<(OutputBuffer &out, const Value &value) {
+    if (value.isType<Integer>()) {
+        char *buffer = out.reserve(NUMBER_BUFFER_SIZE);
+        out.commit(formatInteger(buffer, value.asType<Integer>()));
+        return out;
+    } else if (value.isType<Number>()) {
+        char *buffer = out.reserve(NUMBER_BUFFER_SIZE);
+        out.commit(formatNumber(buffer, value.asType<Number>()));
+        return out;
+    } else if (value.isType<ObjString *>()) {
+        const ObjString *str = value.asType<ObjString *>();
+        return out << std::string_view(str->data(), str->size());
+    }
+
+    std::string text = std::visit(ToStringVisitor(), value);
+    return out << std::string_view(text);
+}
+
 } // namespace Clox
@@ -1,12 +1,15 @@
 #ifndef CLOXPP_VALUE_H
 #define CLOXPP_VALUE_H
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <variant>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+class OutputBuffer;
+
 namespace Jlox {
 
 // forward declare some types here, to be included in Value
@@ -20,6 +23,7 @@ using Value = std::variant<std::monostate, std::string, double, bool,
                            LoxCallablePtr, LoxInstancePtr>;
 
 std::ostream &operator<<(std::ostream &os, const Value &value);
+OutputBuffer &operator<<(OutputBuffer &out, const Value &value);
 
 } // namespace Jlox
 
@@ -60,8 +64,14 @@ class ObjUpvalue;
 
 using Nil = std::monostate;
 using Number = double;
-using ValueTypes = Variant<Nil, Number, bool, ObjString *, ObjFunction *,
-                           ObjNative *, ObjClosure *, ObjUpvalue *>;
+// A Number that is integral and within 2^53 of zero, where doubles are
+// still exact, kept as an integer to make integer arithmetic cheaper. Lox
+// programs can't tell it apart from the Number with the same value.
+using Integer = int64_t;
+constexpr Integer INTEGER_MAX = Integer(1) << 53;
+using ValueTypes = Variant<Nil, Number, Integer, bool, ObjString *,
+                           ObjFunction *, ObjNative *, ObjClosure *,
+                           ObjUpvalue *>;
 class Value : public ValueTypes {
 public:
     Value() : ValueTypes(std::in_place_type<Nil>) {}
@@ -71,9 +81,81 @@ public:
 
     bool operator==(const Value &other) const;
     bool isFalsey() const;
+
+    bool isNumber() const { return isType<Integer>() || isType<Number>(); }
+    Number asNumber() const {
+        return isType<Integer>() ? static_cast<Number>(asType<Integer>())
+                                 : asType<Number>();
+    }
 };
 
+/*
+ * Arithmetic on two numbers. An Integer result is only produced where
+ * the double result would be the same integral value, so overflow, -0
+ * and fractions all fall back to a Number.
+ */
+inline bool isExactInteger(Integer value) {
+    return value >= -INTEGER_MAX && value <= INTEGER_MAX;
+}
+
+// a + b and a * b on doubles, kept out of line: inlined, the compiler may
+// swap the operands of these commutative instructions, which changes
+// which of two NaNs the result carries
+Number addDoubles(Number a, Number b);
+Number multiplyDoubles(Number a, Number b);
+
+inline Value addNumbers(const Value &a, const Value &b) {
+    if (a.isType<Integer>() && b.isType<Integer>()) {
+        Integer result = a.asType<Integer>() + b.asType<Integer>();
+        if (isExactInteger(result))
+            return result;
+    }
+    return addDoubles(a.asNumber(), b.asNumber());
+}
+
+inline Value subtractNumbers(const Value &a, const Value &b) {
+    if (a.isType<Integer>() && b.isType<Integer>()) {
+        Integer result = a.asType<Integer>() - b.asType<Integer>();
+        if (isExactInteger(result))
+            return result;
+    }
+    return a.asNumber() - b.asNumber();
+}
+
+inline Value multiplyNumbers(const Value &a, const Value &b) {
+    if (a.isType<Integer>() && b.isType<Integer>()) {
+        Integer x = a.asType<Integer>();
+        Integer y = b.asType<Integer>();
+        Integer result;
+        if (!__builtin_mul_overflow(x, y, &result) && isExactInteger(result) &&
+            (result != 0 || (x >= 0 && y >= 0)))
+            return result;
+    }
+    return multiplyDoubles(a.asNumber(), b.asNumber());
+}
+
+inline Value divideNumbers(const Value &a, const Value &b) {
+    return a.asNumber() / b.asNumber();
+}
+
+inline Value negateNumber(const Value &a) {
+    if (a.isType<Integer>() && a.asType<Integer>() != 0)
+        return -a.asType<Integer>();
+    return -a.asNumber();
+}
+
+inline bool lessNumbers(const Value &a, const Value &b) {
+    if (a.isType<Integer>() && b.isType<Integer>())
+        return a.asType<Integer>() < b.asType<Integer>();
+    return a.asNumber() < b.asNumber();
+}
+
+inline bool greaterNumbers(const Value &a, const Value &b) {
+    return lessNumbers(b, a);
+}
+
 std::ostream &operator<<(std::ostream &os, const Value &value);
+OutputBuffer &operator<<(OutputBuffer &out, const Value &value);
 
 struct ValueArray {
     int capacity;
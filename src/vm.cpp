@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdarg>
 #include <cstdio>
@@ -10,7 +11,10 @@
 
 namespace Clox {
 
-VM::VM() : frameCount(0), globals({}), openUpvalues({}) {
+VM::VM()
+    : frameCount(0), globals({}), builtins({}), predecoding(false),
+      stackCaching(false), useRegisters(false), errors(stderr) {
+    Heap::Scope scope(heap);
     resetStack();
     defineNative("clock", [](int, Value *) -> Value {
         return static_cast<double>(
@@ -22,22 +26,49 @@ VM::VM() : frameCount(0), globals({}), openUpvalues({}) {
     });
 }
 
-VM::~VM() { Allocator::cleanUp(); }
-
 InterpretResult VM::interpret(const std::string &source) {
-    ObjFunction *function = SinglePassCompiler::compile(source);
+    Heap::Scope scope(heap);
+    ObjFunction *function =
+        SinglePassCompiler::compile(source, /*lazy=*/false, errors);
     if (!function) {
         return InterpretResult::COMPILE_ERROR;
     }
 
+    return interpret(function);
+}
+
+InterpretResult VM::interpret(ObjFunction *function) {
+    Heap::Scope scope(heap);
     push(function);
     ObjClosure *closure = Allocator::create<ObjClosure>(function);
     pop();
     push(closure);
     call(closure, 0);
-    return run();
+    InterpretResult result;
+    if (predecoding)
+        result = runDecoded();
+    else if (useRegisters)
+        result = runRegisters();
+    else
+        result = stackCaching ? runCached() : run();
+    output.flush();
+    return result;
+}
+
+void VM::enablePredecoding() { predecoding = true; }
+
+void VM::enableStackCaching() { stackCaching = true; }
+
+void VM::enableRegisters() { useRegisters = true; }
+
+void VM::setFlushPolicy(OutputBuffer::FlushPolicy policy) {
+    output.setFlushPolicy(policy);
 }
 
+void VM::captureOutput(std::string &sink) { output.captureInto(sink); }
+
+void VM::setErrorStream(std::FILE *errors) { this->errors = errors; }
+
 InterpretResult VM::run() {
     CallFrame *frame = &frames[frameCount - 1];
 
@@ -48,14 +79,58 @@ InterpretResult VM::run() {
 #define READ_SHORT()                                                           \
     (frame->ip += 2,                                                           \
      static_cast<uint16_t>((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_OP(valueType, op)                                               \
+#define READ_LONG()                                                            \
+    (frame->ip += 3,                                                           \
+     static_cast<uint32_t>((frame->ip[-3] << 16) | (frame->ip[-2] << 8) |      \
+                           frame->ip[-1]))
+#define READ_CONSTANT_LONG()                                                   \
+    (frame->closure->function->getChunk()->constants.values[READ_LONG()])
+#define READ_STRING_LONG() (READ_CONSTANT_LONG().asType<ObjString *>())
+#define BINARY_OP(function)                                                    \
     do {                                                                       \
-        if (!peek(0).isType<Number>() || !peek(1).isType<Number>()) {          \
+        if (!peek(0).isNumber() || !peek(1).isNumber()) {                      \
             runtimeError("Operands must be numbers.");                         \
+            return InterpretResult::RUNTIME_ERROR;                             \
         }                                                                      \
-        auto b = pop().asType<Number>();                                       \
-        auto a = pop().asType<Number>();                                       \
-        push(static_cast<valueType>(a op b));                                  \
+        Value b = pop();                                                       \
+        Value a = pop();                                                       \
+        push(function(a, b));                                                  \
+    } while (false)
+// The three forms of a fused compare-and-jump: `compare` reads the operands
+// `a` and `b` and skips the jump when the comparison holds.
+#define COMPARE_JUMP_CASES(opcode, compare)                                    \
+    case opcode: {                                                             \
+        Value b = pop();                                                       \
+        Value a = pop();                                                       \
+        compare;                                                               \
+        break;                                                                 \
+    }                                                                          \
+    case opcode##_LOCALS: {                                                    \
+        const Value &a = frame->slots[READ_BYTE()];                            \
+        const Value &b = frame->slots[READ_BYTE()];                            \
+        compare;                                                               \
+        break;                                                                 \
+    }                                                                          \
+    case opcode##_LOCAL_CONST: {                                               \
+        const Value &a = frame->slots[READ_BYTE()];                            \
+        const Value &b = READ_CONSTANT();                                      \
+        compare;                                                               \
+        break;                                                                 \
+    }
+#define JUMP_UNLESS(condition)                                                 \
+    do {                                                                       \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!(condition))                                                      \
+            frame->ip += offset;                                               \
+    } while (false)
+// `condition` compares the numbers `a` and `b`
+#define JUMP_UNLESS_NUMBERS(condition)                                         \
+    do {                                                                       \
+        if (!a.isNumber() || !b.isNumber()) {                                  \
+            runtimeError("Operands must be numbers.");                         \
+            return InterpretResult::RUNTIME_ERROR;                             \
+        }                                                                      \
+        JUMP_UNLESS(condition);                                                \
     } while (false)
 
     for (;;) {
@@ -78,6 +153,11 @@ InterpretResult VM::run() {
             push(constant);
             break;
         }
+        case OP_CONSTANT_LONG: {
+            Value constant = READ_CONSTANT_LONG();
+            push(constant);
+            break;
+        }
         case OP_NIL: {
             push(Nil{});
             break;
@@ -104,8 +184,10 @@ InterpretResult VM::run() {
             frame->slots[slot] = peek(0);
             break;
         }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_GET_GLOBAL ? READ_STRING()
+                                                           : READ_STRING_LONG();
             auto maybeVal = globals.get(name);
             if (!maybeVal.has_value()) {
                 runtimeError("Undefined variable '%s'", name->data());
@@ -114,14 +196,19 @@ InterpretResult VM::run() {
             push(maybeVal.value());
             break;
         }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_DEFINE_GLOBAL
+                                  ? READ_STRING()
+                                  : READ_STRING_LONG();
             globals.set(name, peek(0));
             pop();
             break;
         }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_SET_GLOBAL ? READ_STRING()
+                                                           : READ_STRING_LONG();
             if (globals.set(name, peek(0))) {
                 globals.deleteKey(name);
                 runtimeError("Undefined variable '%s'.", name->data());
@@ -132,12 +219,21 @@ InterpretResult VM::run() {
         }
         case OP_GET_UPVALUE: {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            auto *upvalue =
+                frame->closure->upvalues[slot].asType<ObjUpvalue *>();
+            push(*upvalue->location);
             break;
         }
         case OP_SET_UPVALUE: {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            auto *upvalue =
+                frame->closure->upvalues[slot].asType<ObjUpvalue *>();
+            *upvalue->location = peek(0);
+            break;
+        }
+        case OP_GET_FLAT_UPVALUE: {
+            uint8_t slot = READ_BYTE();
+            push(frame->closure->upvalues[slot]);
             break;
         }
         case OP_EQUAL: {
@@ -147,11 +243,11 @@ InterpretResult VM::run() {
             break;
         }
         case OP_GREATER: {
-            BINARY_OP(bool, >);
+            BINARY_OP(greaterNumbers);
             break;
         }
         case OP_LESS: {
-            BINARY_OP(bool, <);
+            BINARY_OP(lessNumbers);
             break;
         }
         case OP_ADD: {
@@ -161,10 +257,10 @@ InterpretResult VM::run() {
                 ObjString *a = pop().asType<ObjString *>();
                 ObjString *result = ObjString::concatenate(*a, *b);
                 push(result);
-            } else if (peek(0).isType<Number>() && peek(1).isType<Number>()) {
-                auto b = pop().asType<Number>();
-                auto a = pop().asType<Number>();
-                push(a + b);
+            } else if (peek(0).isNumber() && peek(1).isNumber()) {
+                Value b = pop();
+                Value a = pop();
+                push(addNumbers(a, b));
             } else {
                 runtimeError("Operands must be two numbers or two strings.");
                 return InterpretResult::RUNTIME_ERROR;
@@ -172,15 +268,15 @@ InterpretResult VM::run() {
             break;
         }
         case OP_SUBTRACT: {
-            BINARY_OP(Number, -);
+            BINARY_OP(subtractNumbers);
             break;
         }
         case OP_MULTIPLY: {
-            BINARY_OP(Number, *);
+            BINARY_OP(multiplyNumbers);
             break;
         }
         case OP_DIVIDE: {
-            BINARY_OP(Number, /);
+            BINARY_OP(divideNumbers);
             break;
         }
         case OP_NOT: {
@@ -188,15 +284,15 @@ InterpretResult VM::run() {
             break;
         }
         case OP_NEGATE: {
-            if (!peek(0).isType<Number>()) {
+            if (!peek(0).isNumber()) {
                 runtimeError("Operand must be a number.");
                 return InterpretResult::RUNTIME_ERROR;
             }
-            push(-pop().asType<Number>());
+            push(negateNumber(pop()));
             break;
         }
         case OP_PRINT: {
-            std::cout << pop() << "\n";
+            output << pop() << '\n';
             break;
         }
         case OP_JUMP: {
@@ -204,17 +300,45 @@ InterpretResult VM::run() {
             frame->ip += offset;
             break;
         }
+        case OP_JUMP_LONG: {
+            uint32_t offset = READ_LONG();
+            frame->ip += offset;
+            break;
+        }
         case OP_JUMP_IF_FALSE: {
             uint64_t offset = READ_SHORT();
             if (peek(0).isFalsey())
                 frame->ip += offset;
             break;
         }
+        case OP_JUMP_IF_FALSE_LONG: {
+            uint32_t offset = READ_LONG();
+            if (peek(0).isFalsey())
+                frame->ip += offset;
+            break;
+        }
+        // `<=` and `>=` are `!(a > b)` and `!(a < b)`, as in binary(), so
+        // that comparisons with NaN come out the same whether fused or not
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_LESS,
+                           JUMP_UNLESS_NUMBERS(lessNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_LESS_EQUAL,
+                           JUMP_UNLESS_NUMBERS(!greaterNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_GREATER,
+                           JUMP_UNLESS_NUMBERS(greaterNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_GREATER_EQUAL,
+                           JUMP_UNLESS_NUMBERS(!lessNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_EQUAL, JUMP_UNLESS(a == b))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_EQUAL, JUMP_UNLESS(!(a == b)))
         case OP_LOOP: {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
             break;
         }
+        case OP_LOOP_LONG: {
+            uint32_t offset = READ_LONG();
+            frame->ip -= offset;
+            break;
+        }
         case OP_CALL: {
             int argCount = READ_BYTE();
             if (!callValue(peek(argCount), argCount)) {
@@ -223,30 +347,41 @@ InterpretResult VM::run() {
             frame = &frames[frameCount - 1];
             break;
         }
-        case OP_CLOSURE: {
-            ObjFunction *function = READ_CONSTANT().asType<ObjFunction *>();
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            Value constant = instruction == OP_CLOSURE ? READ_CONSTANT()
+                                                       : READ_CONSTANT_LONG();
+            ObjFunction *function = constant.asType<ObjFunction *>();
             ObjClosure *closure = Allocator::create<ObjClosure>(function);
             push(closure);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                auto isLocal = READ_BYTE();
+                auto kind = READ_BYTE();
                 auto index = READ_BYTE();
-                if (isLocal) {
+                switch (kind) {
+                case CAPTURE_LOCAL:
                     closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                } else {
+                    break;
+                case CAPTURE_LOCAL_VALUE:
+                    // the closure itself is already on the stack, so a
+                    // local function capturing its own slot sees itself
+                    closure->upvalues[i] = frame->slots[index];
+                    break;
+                default:
                     closure->upvalues[i] = frame->closure->upvalues[index];
+                    break;
                 }
             }
             break;
         }
         case OP_CLOSE_UPVALUE: {
-            closeUpvalues(stackTop - 1);
+            closeUpvalues(frame, stackTop - 1);
             pop();
             break;
         }
         case OP_RETURN: {
             Value result = pop();
             frameCount--;
-            closeUpvalues(frame->slots);
+            closeUpvalues(frame, frame->slots);
             if (frameCount == 0) {
                 pop(); // pop the main script function
                 return InterpretResult::OK;
@@ -264,9 +399,939 @@ InterpretResult VM::run() {
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef BINARY_OP
+#undef COMPARE_JUMP_CASES
+#undef JUMP_UNLESS
+#undef JUMP_UNLESS_NUMBERS
+}
+
+// Same semantics as `run`, but with `ip`, the top of the stack and the
+// stack pointer kept in locals. The stack is the array below `sp` plus
+// `tos`, so pushes and pops mostly move values between registers. The
+// state is spilled back into the frame and `stackTop` around calls and
+// runtime errors, and `tos` is written out whenever something may read
+// the top slot through memory.
+InterpretResult VM::runCached() {
+    CallFrame *frame;
+    uint8_t *ip;
+    const Value *constants;
+    Value *sp;
+    Value tos;
+
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &frames[frameCount - 1];                                       \
+        ip = frame->ip;                                                        \
+        constants = frame->closure->function->getChunk()->constants.values;    \
+    } while (false)
+#define SPILL()                                                                \
+    do {                                                                       \
+        frame->ip = ip;                                                        \
+        *sp = tos;                                                             \
+        stackTop = sp + 1;                                                     \
+    } while (false)
+#define RELOAD_STACK()                                                         \
+    do {                                                                       \
+        sp = stackTop - 1;                                                     \
+        tos = *sp;                                                             \
+    } while (false)
+#define PUSH(value) (*sp++ = tos, tos = (value))
+#define DROP() (tos = *--sp)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()                                                            \
+    (ip += 3, static_cast<uint32_t>((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+#define READ_STRING() (READ_CONSTANT().asType<ObjString *>())
+#define READ_STRING_LONG() (READ_CONSTANT_LONG().asType<ObjString *>())
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        SPILL();                                                               \
+        runtimeError(__VA_ARGS__);                                             \
+        return InterpretResult::RUNTIME_ERROR;                                 \
+    } while (false)
+#define BINARY_OP(function)                                                    \
+    do {                                                                       \
+        if (!tos.isNumber() || !sp[-1].isNumber()) {                           \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        Value a = *--sp;                                                       \
+        tos = function(a, tos);                                                \
+    } while (false)
+#define COMPARE_JUMP_CASES(opcode, compare)                                    \
+    case opcode: {                                                             \
+        Value b = tos;                                                         \
+        Value a = *--sp;                                                       \
+        DROP();                                                                \
+        compare;                                                               \
+        break;                                                                 \
+    }                                                                          \
+    case opcode##_LOCALS: {                                                    \
+        *sp = tos;                                                             \
+        const Value &a = frame->slots[READ_BYTE()];                            \
+        const Value &b = frame->slots[READ_BYTE()];                            \
+        compare;                                                               \
+        break;                                                                 \
+    }                                                                          \
+    case opcode##_LOCAL_CONST: {                                               \
+        *sp = tos;                                                             \
+        const Value &a = frame->slots[READ_BYTE()];                            \
+        const Value &b = READ_CONSTANT();                                      \
+        compare;                                                               \
+        break;                                                                 \
+    }
+#define JUMP_UNLESS(condition)                                                 \
+    do {                                                                       \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!(condition))                                                      \
+            ip += offset;                                                      \
+    } while (false)
+#define JUMP_UNLESS_NUMBERS(condition)                                         \
+    do {                                                                       \
+        if (!a.isNumber() || !b.isNumber()) {                                  \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        JUMP_UNLESS(condition);                                                \
+    } while (false)
+
+    LOAD_FRAME();
+    RELOAD_STACK();
+
+    for (;;) {
+#ifdef DEBUG_TRACE_EXECUTION
+        *sp = tos;
+        std::printf("          ");
+        for (Value *slot = stack; slot <= sp; slot++) {
+            std::cout << "[ " << *slot << " ]";
+        }
+        std::cout << "\n";
+        disassembleInstruction(
+            frame->closure->function->getChunk(),
+            static_cast<int>(ip - frame->closure->function->getChunk()->code));
+#endif // DEBUG_TRACE_EXECUTION
+
+        uint8_t instruction;
+        switch (instruction = READ_BYTE()) {
+        case OP_CONSTANT:
+            PUSH(READ_CONSTANT());
+            break;
+        case OP_CONSTANT_LONG:
+            PUSH(READ_CONSTANT_LONG());
+            break;
+        case OP_NIL:
+            PUSH(Nil{});
+            break;
+        case OP_TRUE:
+            PUSH(true);
+            break;
+        case OP_FALSE:
+            PUSH(false);
+            break;
+        case OP_POP:
+            DROP();
+            break;
+        case OP_GET_LOCAL:
+            // `tos` is stored first, so that the top slot reads right too
+            PUSH(frame->slots[READ_BYTE()]);
+            break;
+        case OP_SET_LOCAL:
+            // the assigned value is on top, so the local is in memory
+            frame->slots[READ_BYTE()] = tos;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_GET_GLOBAL ? READ_STRING()
+                                                           : READ_STRING_LONG();
+            auto maybeVal = globals.get(name);
+            if (!maybeVal.has_value()) {
+                RUNTIME_ERROR("Undefined variable '%s'", name->data());
+            }
+            PUSH(maybeVal.value());
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_DEFINE_GLOBAL
+                                  ? READ_STRING()
+                                  : READ_STRING_LONG();
+            globals.set(name, tos);
+            DROP();
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG: {
+            ObjString *name = instruction == OP_SET_GLOBAL ? READ_STRING()
+                                                           : READ_STRING_LONG();
+            if (globals.set(name, tos)) {
+                globals.deleteKey(name);
+                RUNTIME_ERROR("Undefined variable '%s'.", name->data());
+            }
+            break;
+        }
+        case OP_GET_UPVALUE: {
+            auto *upvalue =
+                frame->closure->upvalues[READ_BYTE()].asType<ObjUpvalue *>();
+            PUSH(*upvalue->location);
+            break;
+        }
+        case OP_SET_UPVALUE: {
+            auto *upvalue =
+                frame->closure->upvalues[READ_BYTE()].asType<ObjUpvalue *>();
+            *upvalue->location = tos;
+            break;
+        }
+        case OP_GET_FLAT_UPVALUE:
+            PUSH(frame->closure->upvalues[READ_BYTE()]);
+            break;
+        case OP_EQUAL: {
+            Value a = *--sp;
+            tos = a == tos;
+            break;
+        }
+        case OP_GREATER:
+            BINARY_OP(greaterNumbers);
+            break;
+        case OP_LESS:
+            BINARY_OP(lessNumbers);
+            break;
+        case OP_ADD: {
+            if (tos.isType<ObjString *>() && sp[-1].isType<ObjString *>()) {
+                ObjString *b = tos.asType<ObjString *>();
+                ObjString *a = (--sp)->asType<ObjString *>();
+                tos = ObjString::concatenate(*a, *b);
+            } else if (tos.isNumber() && sp[-1].isNumber()) {
+                Value a = *--sp;
+                tos = addNumbers(a, tos);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            break;
+        }
+        case OP_SUBTRACT:
+            BINARY_OP(subtractNumbers);
+            break;
+        case OP_MULTIPLY:
+            BINARY_OP(multiplyNumbers);
+            break;
+        case OP_DIVIDE:
+            BINARY_OP(divideNumbers);
+            break;
+        case OP_NOT:
+            tos = tos.isFalsey();
+            break;
+        case OP_NEGATE:
+            if (!tos.isNumber()) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            tos = negateNumber(tos);
+            break;
+        case OP_PRINT:
+            output << tos << '\n';
+            DROP();
+            break;
+        case OP_JUMP: {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            break;
+        }
+        case OP_JUMP_LONG: {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            uint16_t offset = READ_SHORT();
+            if (tos.isFalsey())
+                ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_FALSE_LONG: {
+            uint32_t offset = READ_LONG();
+            if (tos.isFalsey())
+                ip += offset;
+            break;
+        }
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_LESS,
+                           JUMP_UNLESS_NUMBERS(lessNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_LESS_EQUAL,
+                           JUMP_UNLESS_NUMBERS(!greaterNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_GREATER,
+                           JUMP_UNLESS_NUMBERS(greaterNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_GREATER_EQUAL,
+                           JUMP_UNLESS_NUMBERS(!lessNumbers(a, b)))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_NOT_EQUAL, JUMP_UNLESS(a == b))
+        COMPARE_JUMP_CASES(OP_JUMP_IF_EQUAL, JUMP_UNLESS(!(a == b)))
+        case OP_LOOP: {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            break;
+        }
+        case OP_LOOP_LONG: {
+            uint32_t offset = READ_LONG();
+            ip -= offset;
+            break;
+        }
+        case OP_CALL: {
+            int argCount = READ_BYTE();
+            SPILL();
+            if (!callValue(peek(argCount), argCount)) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            RELOAD_STACK();
+            break;
+        }
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            Value constant = instruction == OP_CLOSURE ? READ_CONSTANT()
+                                                       : READ_CONSTANT_LONG();
+            ObjFunction *function = constant.asType<ObjFunction *>();
+            ObjClosure *closure = Allocator::create<ObjClosure>(function);
+            PUSH(closure);
+            // a local function capturing its own slot reads it from memory
+            *sp = tos;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                auto kind = READ_BYTE();
+                auto index = READ_BYTE();
+                switch (kind) {
+                case CAPTURE_LOCAL:
+                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    break;
+                case CAPTURE_LOCAL_VALUE:
+                    closure->upvalues[i] = frame->slots[index];
+                    break;
+                default:
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    break;
+                }
+            }
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            *sp = tos;
+            closeUpvalues(frame, sp);
+            DROP();
+            break;
+        case OP_RETURN: {
+            Value result = tos;
+            frameCount--;
+            closeUpvalues(frame, frame->slots);
+            if (frameCount == 0) {
+                stackTop = frame->slots; // pop the main script function
+                return InterpretResult::OK;
+            }
+
+            sp = frame->slots;
+            tos = result;
+            LOAD_FRAME();
+            break;
+        }
+        }
+    }
+
+#undef LOAD_FRAME
+#undef SPILL
+#undef RELOAD_STACK
+#undef PUSH
+#undef DROP
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_STRING
+#undef READ_STRING_LONG
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef COMPARE_JUMP_CASES
+#undef JUMP_UNLESS
+#undef JUMP_UNLESS_NUMBERS
 }
 
+// Same semantics as `run`, over the three-address instructions of each
+// chunk's RegisterChunk.
+InterpretResult VM::runRegisters() {
+    CallFrame *frame;
+    const RegisterInstruction *code;
+    const RegisterInstruction *pc;
+    Value *slots;
+    const Value *constants;
+
+// translates the chunk of a frame when it is first entered
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &frames[frameCount - 1];                                       \
+        Chunk *chunk = frame->closure->function->getChunk();                   \
+        if (!chunk->registers)                                                 \
+            chunk->registers = RegisterChunk::translate(                       \
+                *chunk, frame->closure->function->getArity());                 \
+        code = chunk->registers->begin();                                      \
+        pc = frame->registerPc ? frame->registerPc : code;                     \
+        slots = frame->slots;                                                  \
+        constants = chunk->constants.values;                                   \
+    } while (false)
+#define RK(operand) ((operand) >= 0 ? slots[(operand)] : constants[~(operand)])
+#define READ_STRING(operand) (constants[(operand)].asType<ObjString *>())
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        frame->registerPc = pc;                                                \
+        runtimeError(__VA_ARGS__);                                             \
+        return InterpretResult::RUNTIME_ERROR;                                 \
+    } while (false)
+#define BINARY_OP(function)                                                    \
+    do {                                                                       \
+        const Value &a = RK(instruction->b);                                   \
+        const Value &b = RK(instruction->c);                                   \
+        if (!a.isNumber() || !b.isNumber()) {                                  \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        slots[instruction->a] = function(a, b);                                \
+    } while (false)
+#define COMPARE_JUMP_CASE(opcode, compare)                                     \
+    case opcode: {                                                             \
+        const Value &a = RK(instruction->b);                                   \
+        const Value &b = RK(instruction->c);                                   \
+        compare;                                                               \
+        break;                                                                 \
+    }
+#define JUMP_UNLESS(condition)                                                 \
+    do {                                                                       \
+        if (!(condition))                                                      \
+            pc = code + instruction->a;                                        \
+    } while (false)
+#define JUMP_UNLESS_NUMBERS(condition)                                         \
+    do {                                                                       \
+        if (!a.isNumber() || !b.isNumber()) {                                  \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        JUMP_UNLESS(condition);                                                \
+    } while (false)
+
+    LOAD_FRAME();
+
+    for (;;) {
+#ifdef DEBUG_TRACE_EXECUTION
+        disassembleInstruction(
+            frame->closure->function->getChunk(),
+            frame->closure->function->getChunk()->registers->offsetOf(pc));
+#endif // DEBUG_TRACE_EXECUTION
+
+        const RegisterInstruction *instruction = pc++;
+        switch (instruction->op) {
+        case ROP_MOVE:
+            slots[instruction->a] = RK(instruction->b);
+            break;
+        case ROP_NIL:
+            slots[instruction->a] = Nil{};
+            break;
+        case ROP_TRUE:
+            slots[instruction->a] = true;
+            break;
+        case ROP_FALSE:
+            slots[instruction->a] = false;
+            break;
+        case ROP_GET_GLOBAL: {
+            ObjString *name = READ_STRING(instruction->b);
+            auto maybeVal = globals.get(name);
+            if (!maybeVal.has_value()) {
+                RUNTIME_ERROR("Undefined variable '%s'", name->data());
+            }
+            slots[instruction->a] = maybeVal.value();
+            break;
+        }
+        case ROP_DEFINE_GLOBAL:
+            globals.set(READ_STRING(instruction->a), RK(instruction->b));
+            break;
+        case ROP_SET_GLOBAL: {
+            ObjString *name = READ_STRING(instruction->a);
+            if (globals.set(name, RK(instruction->b))) {
+                globals.deleteKey(name);
+                RUNTIME_ERROR("Undefined variable '%s'.", name->data());
+            }
+            break;
+        }
+        case ROP_GET_UPVALUE: {
+            auto *upvalue = frame->closure->upvalues[instruction->b]
+                                .asType<ObjUpvalue *>();
+            slots[instruction->a] = *upvalue->location;
+            break;
+        }
+        case ROP_SET_UPVALUE: {
+            auto *upvalue = frame->closure->upvalues[instruction->a]
+                                .asType<ObjUpvalue *>();
+            *upvalue->location = RK(instruction->b);
+            break;
+        }
+        case ROP_GET_FLAT_UPVALUE:
+            slots[instruction->a] = frame->closure->upvalues[instruction->b];
+            break;
+        case ROP_EQUAL:
+            slots[instruction->a] = RK(instruction->b) == RK(instruction->c);
+            break;
+        case ROP_GREATER:
+            BINARY_OP(greaterNumbers);
+            break;
+        case ROP_LESS:
+            BINARY_OP(lessNumbers);
+            break;
+        case ROP_ADD: {
+            const Value &a = RK(instruction->b);
+            const Value &b = RK(instruction->c);
+            if (a.isType<ObjString *>() && b.isType<ObjString *>()) {
+                slots[instruction->a] = ObjString::concatenate(
+                    *a.asType<ObjString *>(), *b.asType<ObjString *>());
+            } else if (a.isNumber() && b.isNumber()) {
+                slots[instruction->a] = addNumbers(a, b);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            break;
+        }
+        case ROP_SUBTRACT:
+            BINARY_OP(subtractNumbers);
+            break;
+        case ROP_MULTIPLY:
+            BINARY_OP(multiplyNumbers);
+            break;
+        case ROP_DIVIDE:
+            BINARY_OP(divideNumbers);
+            break;
+        case ROP_NOT:
+            slots[instruction->a] = RK(instruction->b).isFalsey();
+            break;
+        case ROP_NEGATE: {
+            const Value &value = RK(instruction->b);
+            if (!value.isNumber()) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            slots[instruction->a] = negateNumber(value);
+            break;
+        }
+        case ROP_PRINT:
+            output << RK(instruction->a) << '\n';
+            break;
+        case ROP_JUMP:
+            pc = code + instruction->a;
+            break;
+        case ROP_JUMP_IF_FALSE:
+            if (RK(instruction->b).isFalsey())
+                pc = code + instruction->a;
+            break;
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_NOT_LESS,
+                          JUMP_UNLESS_NUMBERS(lessNumbers(a, b)))
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_NOT_LESS_EQUAL,
+                          JUMP_UNLESS_NUMBERS(!greaterNumbers(a, b)))
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_NOT_GREATER,
+                          JUMP_UNLESS_NUMBERS(greaterNumbers(a, b)))
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_NOT_GREATER_EQUAL,
+                          JUMP_UNLESS_NUMBERS(!lessNumbers(a, b)))
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_NOT_EQUAL, JUMP_UNLESS(a == b))
+        COMPARE_JUMP_CASE(ROP_JUMP_IF_EQUAL, JUMP_UNLESS(!(a == b)))
+        case ROP_CALL: {
+            int argCount = instruction->b;
+            frame->registerPc = pc;
+            stackTop = slots + instruction->a + argCount + 1;
+            if (!callValue(slots[instruction->a], argCount)) {
+                return InterpretResult::RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            break;
+        }
+        case ROP_CLOSURE: {
+            auto *function = constants[instruction->b].asType<ObjFunction *>();
+            ObjClosure *closure = Allocator::create<ObjClosure>(function);
+            // stored first, so that a local function capturing its own
+            // slot sees itself
+            slots[instruction->a] = closure;
+            const uint8_t *captures =
+                frame->closure->function->getChunk()->code + instruction->c;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                auto kind = *captures++;
+                auto index = *captures++;
+                switch (kind) {
+                case CAPTURE_LOCAL:
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                    break;
+                case CAPTURE_LOCAL_VALUE:
+                    closure->upvalues[i] = slots[index];
+                    break;
+                default:
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    break;
+                }
+            }
+            break;
+        }
+        case ROP_CLOSE_UPVALUE:
+            closeUpvalues(frame, slots + instruction->a);
+            break;
+        case ROP_RETURN: {
+            Value result = RK(instruction->a);
+            frameCount--;
+            closeUpvalues(frame, slots);
+            if (frameCount == 0) {
+                stackTop = slots; // pop the main script function
+                return InterpretResult::OK;
+            }
+
+            // where the caller expects the result
+            *slots = result;
+            LOAD_FRAME();
+            break;
+        }
+        }
+    }
+
+#undef LOAD_FRAME
+#undef RK
+#undef READ_STRING
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef COMPARE_JUMP_CASE
+#undef JUMP_UNLESS
+#undef JUMP_UNLESS_NUMBERS
+}
+
+#if defined(__GNUC__)
+// Same semantics as `run`, over the Instructions of each chunk's
+// DecodedChunk, dispatched through handler addresses (computed goto).
+InterpretResult VM::runDecoded() {
+    // every opcode's handler; long forms share the short form's, and loops
+    // are jumps whose target lies behind them
+    const void *handlers[OP_RETURN + 1];
+    handlers[OP_CONSTANT] = handlers[OP_CONSTANT_LONG] = &&op_constant;
+    handlers[OP_NIL] = &&op_nil;
+    handlers[OP_TRUE] = &&op_true;
+    handlers[OP_FALSE] = &&op_false;
+    handlers[OP_POP] = &&op_pop;
+    handlers[OP_GET_LOCAL] = &&op_get_local;
+    handlers[OP_SET_LOCAL] = &&op_set_local;
+    handlers[OP_GET_GLOBAL] = handlers[OP_GET_GLOBAL_LONG] = &&op_get_global;
+    handlers[OP_DEFINE_GLOBAL] = handlers[OP_DEFINE_GLOBAL_LONG] =
+        &&op_define_global;
+    handlers[OP_SET_GLOBAL] = handlers[OP_SET_GLOBAL_LONG] = &&op_set_global;
+    handlers[OP_GET_UPVALUE] = &&op_get_upvalue;
+    handlers[OP_SET_UPVALUE] = &&op_set_upvalue;
+    handlers[OP_GET_FLAT_UPVALUE] = &&op_get_flat_upvalue;
+    handlers[OP_EQUAL] = &&op_equal;
+    handlers[OP_GREATER] = &&op_greater;
+    handlers[OP_LESS] = &&op_less;
+    handlers[OP_ADD] = &&op_add;
+    handlers[OP_SUBTRACT] = &&op_subtract;
+    handlers[OP_MULTIPLY] = &&op_multiply;
+    handlers[OP_DIVIDE] = &&op_divide;
+    handlers[OP_NOT] = &&op_not;
+    handlers[OP_NEGATE] = &&op_negate;
+    handlers[OP_PRINT] = &&op_print;
+    handlers[OP_JUMP] = handlers[OP_JUMP_LONG] = &&op_jump;
+    handlers[OP_LOOP] = handlers[OP_LOOP_LONG] = &&op_jump;
+    handlers[OP_JUMP_IF_FALSE] = handlers[OP_JUMP_IF_FALSE_LONG] =
+        &&op_jump_if_false;
+    handlers[OP_JUMP_IF_NOT_LESS] = &&op_jump_if_not_less;
+    handlers[OP_JUMP_IF_NOT_LESS_LOCALS] = &&op_jump_if_not_less_locals;
+    handlers[OP_JUMP_IF_NOT_LESS_LOCAL_CONST] =
+        &&op_jump_if_not_less_local_const;
+    handlers[OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_jump_if_not_less_equal;
+    handlers[OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS] =
+        &&op_jump_if_not_less_equal_locals;
+    handlers[OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONST] =
+        &&op_jump_if_not_less_equal_local_const;
+    handlers[OP_JUMP_IF_NOT_GREATER] = &&op_jump_if_not_greater;
+    handlers[OP_JUMP_IF_NOT_GREATER_LOCALS] = &&op_jump_if_not_greater_locals;
+    handlers[OP_JUMP_IF_NOT_GREATER_LOCAL_CONST] =
+        &&op_jump_if_not_greater_local_const;
+    handlers[OP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_jump_if_not_greater_equal;
+    handlers[OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS] =
+        &&op_jump_if_not_greater_equal_locals;
+    handlers[OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONST] =
+        &&op_jump_if_not_greater_equal_local_const;
+    handlers[OP_JUMP_IF_NOT_EQUAL] = &&op_jump_if_not_equal;
+    handlers[OP_JUMP_IF_NOT_EQUAL_LOCALS] = &&op_jump_if_not_equal_locals;
+    handlers[OP_JUMP_IF_NOT_EQUAL_LOCAL_CONST] =
+        &&op_jump_if_not_equal_local_const;
+    handlers[OP_JUMP_IF_EQUAL] = &&op_jump_if_equal;
+    handlers[OP_JUMP_IF_EQUAL_LOCALS] = &&op_jump_if_equal_locals;
+    handlers[OP_JUMP_IF_EQUAL_LOCAL_CONST] = &&op_jump_if_equal_local_const;
+    handlers[OP_CALL] = &&op_call;
+    handlers[OP_CLOSURE] = handlers[OP_CLOSURE_LONG] = &&op_closure;
+    handlers[OP_CLOSE_UPVALUE] = &&op_close_upvalue;
+    handlers[OP_RETURN] = &&op_return;
+
+    CallFrame *frame;
+    const Instruction *instruction;
+
+#define ENTER_FRAME()                                                          \
+    do {                                                                       \
+        frame = &frames[frameCount - 1];                                       \
+        if (!frame->pc) {                                                      \
+            Chunk *chunk = frame->closure->function->getChunk();               \
+            if (!chunk->decoded)                                               \
+                chunk->decoded = DecodedChunk::decode(*chunk, handlers);       \
+            frame->pc = chunk->decoded->begin();                               \
+        }                                                                      \
+    } while (false)
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
+    do {                                                                       \
+        std::printf("          ");                                             \
+        for (Value *slot = stack; slot < stackTop; slot++) {                   \
+            std::cout << "[ " << *slot << " ]";                                \
+        }                                                                      \
+        std::cout << "\n";                                                     \
+        disassembleInstruction(frame->closure->function->getChunk(),           \
+                               frame->pc->offset);                             \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+    do {                                                                       \
+    } while (false)
+#endif // DEBUG_TRACE_EXECUTION
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        TRACE_INSTRUCTION();                                                   \
+        instruction = frame->pc++;                                             \
+        goto *instruction->handler;                                            \
+    } while (false)
+#define BINARY_OP(function)                                                    \
+    do {                                                                       \
+        if (!peek(0).isNumber() || !peek(1).isNumber()) {                      \
+            runtimeError("Operands must be numbers.");                         \
+            return InterpretResult::RUNTIME_ERROR;                             \
+        }                                                                      \
+        Value b = pop();                                                       \
+        Value a = pop();                                                       \
+        push(function(a, b));                                                  \
+    } while (false)
+// The three forms of a fused compare-and-jump, as in `run`
+#define COMPARE_JUMP_HANDLERS(label, compare)                                  \
+    label : {                                                                  \
+        Value b = pop();                                                       \
+        Value a = pop();                                                       \
+        compare;                                                               \
+        DISPATCH();                                                            \
+    }                                                                          \
+    label##_locals : {                                                         \
+        const Value &a = frame->slots[instruction->a.index];                   \
+        const Value &b = frame->slots[instruction->b.index];                   \
+        compare;                                                               \
+        DISPATCH();                                                            \
+    }                                                                          \
+    label##_local_const : {                                                    \
+        const Value &a = frame->slots[instruction->a.index];                   \
+        const Value &b = *instruction->b.constant;                             \
+        compare;                                                               \
+        DISPATCH();                                                            \
+    }
+#define JUMP_UNLESS(condition)                                                 \
+    do {                                                                       \
+        if (!(condition))                                                      \
+            frame->pc = instruction->target;                                   \
+    } while (false)
+#define JUMP_UNLESS_NUMBERS(condition)                                         \
+    do {                                                                       \
+        if (!a.isNumber() || !b.isNumber()) {                                  \
+            runtimeError("Operands must be numbers.");                         \
+            return InterpretResult::RUNTIME_ERROR;                             \
+        }                                                                      \
+        JUMP_UNLESS(condition);                                                \
+    } while (false)
+
+    ENTER_FRAME();
+    DISPATCH();
+
+op_constant:
+    push(*instruction->a.constant);
+    DISPATCH();
+op_nil:
+    push(Nil{});
+    DISPATCH();
+op_true:
+    push(true);
+    DISPATCH();
+op_false:
+    push(false);
+    DISPATCH();
+op_pop:
+    pop();
+    DISPATCH();
+op_get_local:
+    push(frame->slots[instruction->a.index]);
+    DISPATCH();
+op_set_local:
+    frame->slots[instruction->a.index] = peek(0);
+    DISPATCH();
+op_get_global: {
+    ObjString *name = instruction->a.name;
+    auto maybeVal = globals.get(name);
+    if (!maybeVal.has_value()) {
+        runtimeError("Undefined variable '%s'", name->data());
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    push(maybeVal.value());
+    DISPATCH();
+}
+op_define_global:
+    globals.set(instruction->a.name, peek(0));
+    pop();
+    DISPATCH();
+op_set_global: {
+    ObjString *name = instruction->a.name;
+    if (globals.set(name, peek(0))) {
+        globals.deleteKey(name);
+        runtimeError("Undefined variable '%s'.", name->data());
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    DISPATCH();
+}
+op_get_upvalue:
+    push(*frame->closure->upvalues[instruction->a.index]
+              .asType<ObjUpvalue *>()
+              ->location);
+    DISPATCH();
+op_set_upvalue:
+    *frame->closure->upvalues[instruction->a.index]
+         .asType<ObjUpvalue *>()
+         ->location = peek(0);
+    DISPATCH();
+op_get_flat_upvalue:
+    push(frame->closure->upvalues[instruction->a.index]);
+    DISPATCH();
+op_equal: {
+    Value b = pop();
+    Value a = pop();
+    push(a == b);
+    DISPATCH();
+}
+op_greater:
+    BINARY_OP(greaterNumbers);
+    DISPATCH();
+op_less:
+    BINARY_OP(lessNumbers);
+    DISPATCH();
+op_add:
+    if (peek(0).isType<ObjString *>() && peek(1).isType<ObjString *>()) {
+        ObjString *b = pop().asType<ObjString *>();
+        ObjString *a = pop().asType<ObjString *>();
+        push(ObjString::concatenate(*a, *b));
+    } else if (peek(0).isNumber() && peek(1).isNumber()) {
+        Value b = pop();
+        Value a = pop();
+        push(addNumbers(a, b));
+    } else {
+        runtimeError("Operands must be two numbers or two strings.");
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    DISPATCH();
+op_subtract:
+    BINARY_OP(subtractNumbers);
+    DISPATCH();
+op_multiply:
+    BINARY_OP(multiplyNumbers);
+    DISPATCH();
+op_divide:
+    BINARY_OP(divideNumbers);
+    DISPATCH();
+op_not:
+    push(pop().isFalsey());
+    DISPATCH();
+op_negate:
+    if (!peek(0).isNumber()) {
+        runtimeError("Operand must be a number.");
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    push(negateNumber(pop()));
+    DISPATCH();
+op_print:
+    output << pop() << '\n';
+    DISPATCH();
+op_jump:
+    frame->pc = instruction->target;
+    DISPATCH();
+op_jump_if_false:
+    if (peek(0).isFalsey())
+        frame->pc = instruction->target;
+    DISPATCH();
+
+    // clang-format off
+    COMPARE_JUMP_HANDLERS(op_jump_if_not_less,
+                          JUMP_UNLESS_NUMBERS(lessNumbers(a, b)))
+    COMPARE_JUMP_HANDLERS(op_jump_if_not_less_equal,
+                          JUMP_UNLESS_NUMBERS(!greaterNumbers(a, b)))
+    COMPARE_JUMP_HANDLERS(op_jump_if_not_greater,
+                          JUMP_UNLESS_NUMBERS(greaterNumbers(a, b)))
+    COMPARE_JUMP_HANDLERS(op_jump_if_not_greater_equal,
+                          JUMP_UNLESS_NUMBERS(!lessNumbers(a, b)))
+    COMPARE_JUMP_HANDLERS(op_jump_if_not_equal, JUMP_UNLESS(a == b))
+    COMPARE_JUMP_HANDLERS(op_jump_if_equal, JUMP_UNLESS(!(a == b)))
+    // clang-format on
+
+op_call: {
+    int argCount = instruction->a.index;
+    if (!callValue(peek(argCount), argCount)) {
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    ENTER_FRAME();
+    DISPATCH();
+}
+op_closure: {
+    auto *function = instruction->a.constant->asType<ObjFunction *>();
+    ObjClosure *closure = Allocator::create<ObjClosure>(function);
+    push(closure);
+    const uint8_t *captures = instruction->b.captures;
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        auto kind = *captures++;
+        auto index = *captures++;
+        switch (kind) {
+        case CAPTURE_LOCAL:
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+            break;
+        case CAPTURE_LOCAL_VALUE:
+            closure->upvalues[i] = frame->slots[index];
+            break;
+        default:
+            closure->upvalues[i] = frame->closure->upvalues[index];
+            break;
+        }
+    }
+    DISPATCH();
+}
+op_close_upvalue:
+    closeUpvalues(frame, stackTop - 1);
+    pop();
+    DISPATCH();
+op_return: {
+    Value result = pop();
+    frameCount--;
+    closeUpvalues(frame, frame->slots);
+    if (frameCount == 0) {
+        pop(); // pop the main script function
+        return InterpretResult::OK;
+    }
+
+    stackTop = frame->slots;
+    push(result);
+    frame = &frames[frameCount - 1];
+    DISPATCH();
+}
+
+#undef ENTER_FRAME
+#undef TRACE_INSTRUCTION
+#undef DISPATCH
+#undef BINARY_OP
+#undef COMPARE_JUMP_HANDLERS
+#undef JUMP_UNLESS
+#undef JUMP_UNLESS_NUMBERS
+}
+#else
+// Labels as values are a GNU extension, which other compilers may lack;
+// there --predecode runs the switch loop instead.
+InterpretResult VM::runDecoded() { return run(); }
+#endif // __GNUC__
+
 struct Caller {
     VM *vm;
     int argCount;
@@ -304,37 +1369,63 @@ bool VM::call(ObjClosure *closure, int argCount) {
         return false;
     }
 
+    if (!closure->function->isCompiled() &&
+        !SinglePassCompiler::compileLazy(closure->function, errors)) {
+        // the body was already checked, so this shouldn't happen
+        runtimeError("Could not compile %s.", closure->function->getName());
+        return false;
+    }
+
     CallFrame *frame = &frames[frameCount++];
     *frame = {.closure = closure,
               .ip = closure->function->getChunk()->code,
-              .slots = stackTop - argCount - 1};
+              .slots = stackTop - argCount - 1,
+              .openLow = nullptr,
+              .openHigh = nullptr,
+              .pc = nullptr,
+              .registerPc = nullptr};
     return true;
 }
 
 ObjUpvalue *VM::captureUpvalue(Value *local) {
-    auto prev = openUpvalues.cbefore_begin();
-    auto curr = openUpvalues.cbegin();
-    while (curr != openUpvalues.cend() && (*curr)->location > local) {
-        prev = curr;
-        curr++;
+    ObjUpvalue *&open = openUpvalues[local - stack];
+    if (open) {
+        return open;
     }
 
-    if (curr != openUpvalues.cend() && (*curr)->location == local) {
-        return *curr;
-    }
+    open = Allocator::create<ObjUpvalue>(local);
+
+    // locals are only ever captured from the running frame
+    CallFrame *frame = &frames[frameCount - 1];
+    if (!frame->openLow || local < frame->openLow)
+        frame->openLow = local;
+    if (!frame->openHigh || local > frame->openHigh)
+        frame->openHigh = local;
 
-    ObjUpvalue *createdUpvalue = Allocator::create<ObjUpvalue>(local);
-    openUpvalues.insert_after(prev, createdUpvalue);
-    return createdUpvalue;
+    return open;
 }
 
-void VM::closeUpvalues(Value *last) {
-    while (!openUpvalues.empty() && openUpvalues.front()->location >= last) {
-        ObjUpvalue *upvalue = openUpvalues.front();
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
+void VM::closeUpvalues(CallFrame *frame, Value *last) {
+    if (!frame->openLow || last > frame->openHigh) {
+        return;
+    }
+
+    for (Value *slot = std::max(last, frame->openLow); slot <= frame->openHigh;
+         slot++) {
+        ObjUpvalue *&open = openUpvalues[slot - stack];
+        if (!open)
+            continue;
 
-        openUpvalues.pop_front();
+        open->closed = *open->location;
+        open->location = &open->closed;
+        open = nullptr;
+    }
+
+    if (last <= frame->openLow) {
+        frame->openLow = nullptr;
+        frame->openHigh = nullptr;
+    } else {
+        frame->openHigh = last - 1;
     }
 }
 
@@ -353,25 +1444,34 @@ Value VM::peek(int distance) { return *(stackTop - 1 - distance); }
 void VM::resetStack() {
     stackTop = stack;
     frameCount = 0;
+    std::fill(std::begin(openUpvalues), std::end(openUpvalues), nullptr);
 }
 
 void VM::runtimeError(const char *format, ...) {
+    output.flush();
     std::va_list args;
     va_start(args, format);
-    std::vfprintf(stderr, format, args);
+    std::vfprintf(errors, format, args);
     va_end(args);
-    std::fputs("\n", stderr);
+    std::fputs("\n", errors);
 
     for (int i = frameCount - 1; i >= 0; i--) {
         CallFrame *frame = &frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->getChunk()->code - 1;
-        std::fprintf(stderr, "[line %d] in ",
-                     function->getChunk()->lines[instruction]);
+        Chunk *chunk = function->getChunk();
+        int instruction;
+        if (frame->pc) {
+            instruction = frame->pc[-1].offset;
+        } else if (frame->registerPc) {
+            instruction = chunk->registers->offsetOf(frame->registerPc - 1);
+        } else {
+            instruction = static_cast<int>(frame->ip - chunk->code - 1);
+        }
+        std::fprintf(errors, "[line %d] in ", chunk->getLine(instruction));
         if (std::string(function->getName()) == "<script>") {
-            std::fprintf(stderr, "script.\n");
+            std::fprintf(errors, "script.\n");
         } else {
-            std::fprintf(stderr, "%s.\n", function->getName());
+            std::fprintf(errors, "%s.\n", function->getName());
         }
     }
 
@@ -382,6 +1482,7 @@ void VM::defineNative(std::string_view name, NativeFn function) {
     push(ObjString::copy(name));
     push(Allocator::create<ObjNative>(function));
     globals.set(peek(1).asType<ObjString *>(), peek(0));
+    builtins.set(peek(1).asType<ObjString *>(), peek(0));
     pop();
     pop();
 }
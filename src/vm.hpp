@@ -1,9 +1,14 @@
 #ifndef CLOXPP_VM_H
 #define CLOXPP_VM_H
 
-#include <forward_list>
+#include <cstdio>
+#include <string>
 
+#include "decoded_chunk.hpp"
+#include "memory.hpp"
 #include "object.hpp"
+#include "output_buffer.hpp"
+#include "register_chunk.hpp"
 #include "table.hpp"
 
 namespace Clox {
@@ -18,16 +23,43 @@ struct CallFrame {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+    // lowest and highest slot of this frame that may have an open upvalue;
+    // both are null when nothing in the frame has been captured
+    Value *openLow;
+    Value *openHigh;
+    const Instruction *pc; // replaces `ip` in VM::runDecoded
+    const RegisterInstruction *registerPc; // and in VM::runRegisters
 };
 
 struct Caller;
 class VM {
 public:
     VM();
-    ~VM();
     InterpretResult interpret(const std::string &source);
+    InterpretResult interpret(ObjFunction *script);
+
+    // to be entered on the calling thread while compiling or loading code
+    // for this VM; `interpret` enters it itself
+    Heap &getHeap() { return heap; }
+
+    // run code translated by DecodedChunk instead of the bytecode
+    void enablePredecoding();
+    // keep the top of the stack in a local in the bytecode loop
+    void enableStackCaching();
+    // run code translated by RegisterChunk instead of the bytecode
+    void enableRegisters();
+    // when printed output is written out, instead of the default for stdout
+    void setFlushPolicy(OutputBuffer::FlushPolicy policy);
+    // keep printed output in `sink` instead of writing it to stdout
+    void captureOutput(std::string &sink);
+    // report runtime errors, and compile errors of code compiled by the VM,
+    // on `errors` instead of stderr
+    void setErrorStream(std::FILE *errors);
 
 private:
+    // declared first, so that its objects outlive everything else here
+    Heap heap;
+
     static constexpr std::size_t FRAMES_MAX = 64;
     static constexpr std::size_t STACK_MAX = FRAMES_MAX * UINT8_COUNT;
     CallFrame frames[FRAMES_MAX];
@@ -35,15 +67,24 @@ private:
     Value stack[STACK_MAX];
     Value *stackTop;
     Table globals;
-    std::forward_list<ObjUpvalue *> openUpvalues;
+    Table builtins; // natives defined by the VM itself, by name
+    ObjUpvalue *openUpvalues[STACK_MAX]; // indexed by stack slot
+    bool predecoding;
+    bool stackCaching;
+    bool useRegisters;
+    OutputBuffer output; // what print statements write to
+    std::FILE *errors;
 
     InterpretResult run();
+    InterpretResult runCached();
+    InterpretResult runDecoded();
+    InterpretResult runRegisters();
 
     bool callValue(Value callee, int argCount);
     bool call(ObjClosure *closure, int argCount);
 
     ObjUpvalue *captureUpvalue(Value *local);
-    void closeUpvalues(Value *last);
+    void closeUpvalues(CallFrame *frame, Value *last);
 
     void push(Value value);
     Value pop();
@@ -55,6 +96,7 @@ private:
     void defineNative(std::string_view name, NativeFn function);
 
     friend struct Caller;
+    friend class HeapSnapshot;
 };
 
 } // namespace Clox